@@ -1,7 +1,19 @@
+#define _DEFAULT_SOURCE // For madvise and pread.
+
 #include "arena.h"
+#include "arena_inline.h"
+#include "bitmap.h"
+#include "region.h"
+#include "sanitize.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 /**
  * saucetenuto (reddit):
@@ -27,15 +39,16 @@
  * the newly freed chunk to the free list. In this implementation, the first few
  * bytes of the memory given to the user get used for this purpose.
  *
- * When we've given out the whole buffer (with alloc_free) possibly being
- * called throughout this, we set lazy_init to false since all elements are now
- * either in the free list or have been allocated to the user.
- *
- * Now all allocations just consist of lopping off the head of the free list
- * and reusing it.
+ * Allocations take the head of the free list whenever there is one, since
+ * freed elements are likely still in cache, and only move bufstart forward
+ * when the free list is empty. So the only branch on the common path is
+ * whether the free list is empty, and it goes the same way for long
+ * stretches: always empty while the arena fills up, hardly ever once it's in
+ * steady state. When bufstart reaches bufend, every element is either in the
+ * free list or allocated to the user.
  *
- * Finally, if an arena reset happens, we just set lazy_init to true, move
- * bufstart back where it belongs, and empty the free list. Note that we don't
+ * Finally, if an arena reset happens, we just move bufstart back where it
+ * belongs, and empty the free list. Note that we don't
  * actually have to walk the free list, since the contents of each node is
  * undefined anyhow, and the memory won't leak since it's all in the buffer.
  *
@@ -54,63 +67,164 @@
  * this arena. But at least it's safe, dammit.
  */
 
-/*** BEGIN CUSTOMIZATION ***/
+#include "arena_config.h"
 
-// Default implementation - just use standard malloc + free. Feel free to
-// redefine ALLOC and FREE to fit your needs. Obviously, their prototypes must
-// be identical to those of malloc and free.
-#include <stdlib.h>
-#define ALLOC malloc
-#define FREE  free
+#ifdef ARENA_STATS
+    #define STAT(x) (x)
+#else
+    #define STAT(x) ((void)0)
+#endif
 
-// By default, turn on heap checking only in DEBUG builds.
-// If HEAP_CHECK is defined, arena_free and arena_reset become O(n), but you get
-// double-free protection.
-#ifdef DEBUG
-    #define HEAP_CHECK
+#if defined(ARENA_PREFETCH) && defined(__GNUC__)
+    #define PREFETCH(p) __builtin_prefetch(p)
+#else
+    #define PREFETCH(p) ((void)0)
 #endif
 
-#include <stdio.h>
-// Set this to your own custom handling. Once an error has been triggered,
-// heap state is undefined. I suggest changing this to a function which either
-// dumps core or breaks into a debugger. A backtrace is extremely useful when
-// double-frees are detected.
-static void error(const char* message)
-{
-    fputs(message, stderr);
-    fflush(stdout);
-    exit(314);
-}
+/*
+ * Telling ASan and Valgrind which elements are allocated (see sanitize.h).
+ * Every element which isn't is hidden: the bump region, the free list,
+ * everything. The arena's own reads and writes of free nodes PEEK at them
+ * (only the node, or the whole element to check or write poison) and HIDE
+ * them again afterwards.
+ *
+ * hand_out and take_back mark an element's allocation and its free, as far
+ * as the user can tell; an element a free hands straight to a waiter is
+ * never taken back.
+ */
+#ifdef SANITIZED
+    static inline void hand_out(struct arena* a, void* p)
+    {
+        REVEAL(p, a->size);
+        POOL_ALLOC(a, p);
+    }
 
-/*** END CUSTOMIZATION ***/
+    static inline void take_back(struct arena* a, void* p)
+    {
+        POOL_FREE(a, p);
+        HIDE(p, a->size);
+    }
+#else
+    #define hand_out(a, p)  ((void)0)
+    #define take_back(a, p) ((void)0)
+#endif
 
-// This is actually a shadow structure in that we allocate AT LEAST enough
-// space for a node. An unallocated node uses the structure to store a pointer
-// to the next free node. When the node is allocated, the whole structure
-// (including the space for the `next' pointer) is used for user data.
-struct node {
-    uint64_t     guard; // Protects the node from corruption.
-    struct node* next;  // Points to the next free object in the buffer.
-};
+/*
+ * Allocation profiling. Every allocation counts its element's size off
+ * sample_left, and the one which takes it to zero is sampled. `sampled' marks
+ * which elements are, so that frees only call into arena_profile.c for those.
+ *
+ * Stacks start at whoever called into arena.c. How many frames of arena.c
+ * sit above that depends on inlining, so sample takes the return address of
+ * the function it's used in, as a macro, and arena_profile_take skips frames
+ * up to that one.
+ */
+#ifdef ARENA_PROFILE
+    #include "arena_profile.h"
 
-// A fibonacci pattern of bits, to detect corruption. Hopefully unlikely to
-// appear in user code.
-// 1011000111110000000011111111111110000000000000000000001111111111
-// NOTE: The nibbles have been reversed so that on little endian machines the
-// most entropy is in the LSBs, where most manipulation takes place.
-#define GUARD_BITS 0xFF30000811100F1B
-
-struct arena {
-    size_t size;    // The size of each node.
-    size_t count;   // The number of nodes in the buffer.
-    bool lazy_init; // True if we're still initializing the buffer.
-
-    struct node* free_list; // Points to the first node in the free list.
-    struct node* bufstart;  // Points to the first non-initialized element of
-                            // the buffer. If lazy_init is false, is undefined.
-    struct node* buffer;    // Points to the raw arena buffer.
-    struct node* bufend;    // Points one past the last element in the buffer.
-};
+    #ifdef __GNUC__
+        #define CALLER __builtin_return_address(0)
+    #else
+        #define CALLER NULL
+    #endif
+
+    static void take_sample(struct arena* a, struct arena_node* n, const void* caller)
+    {
+        size_t i = (size_t)((char*)n - (char*)a->buffer) / a->size;
+
+        a->sample_left = arena_profile_next();
+
+        if(a->sampled == NULL)
+        {
+            size_t bytes = words_for(a->count)*sizeof(uint64_t);
+
+            if((a->sampled = ALLOC(bytes + 1)) == NULL) // Never ALLOC(0).
+                return;
+
+            memset(a->sampled, 0, bytes);
+        }
+
+        if(arena_profile_take(a, n, a->size, caller))
+            a->sampled[i/64] |= UINT64_C(1) << i % 64;
+    }
+
+    // Called on every element allocated.
+    static inline void sample_at(struct arena* a, struct arena_node* n, const void* caller)
+    {
+        if(ARENA_LIKELY(a->sample_left > a->size))
+            a->sample_left -= a->size;
+        else
+            take_sample(a, n, caller);
+    }
+
+    #define sample(a, n) sample_at((a), (n), CALLER)
+
+    // Called on every element which stops being allocated.
+    static inline void unsample(struct arena* a, struct arena_node* n)
+    {
+        if(ARENA_LIKELY(a->sampled == NULL))
+            return;
+
+        size_t i = (size_t)((char*)n - (char*)a->buffer) / a->size;
+
+        if(test_bit(a->sampled, i))
+        {
+            a->sampled[i/64] &= ~(UINT64_C(1) << i % 64);
+            arena_profile_drop(a, n);
+        }
+    }
+
+    // Drops the samples of every element from the i'th on. O(count/64).
+    static void unsample_from(struct arena* a, size_t i)
+    {
+        if(a->sampled == NULL)
+            return;
+
+        size_t words = words_for(a->count);
+
+        // Only the first word may hold bits below i.
+        if(i % 64 != 0)
+        {
+            uint64_t below = (UINT64_C(1) << i % 64) - 1;
+            uint64_t w     = a->sampled[i/64] & ~below;
+
+            a->sampled[i/64] &= below;
+
+            for(; w != 0; w &= w - 1)
+                arena_profile_drop(a, (char*)a->buffer + (i/64*64 + lowest_bit(w))*a->size);
+
+            i = (i/64 + 1)*64;
+        }
+
+        for(size_t k = first_nonzero(a->sampled, i/64, words); k < words;
+                   k = first_nonzero(a->sampled, k + 1, words))
+        {
+            for(uint64_t w = a->sampled[k]; w != 0; w &= w - 1)
+                arena_profile_drop(a, (char*)a->buffer + (k*64 + lowest_bit(w))*a->size);
+
+            a->sampled[k] = 0;
+        }
+    }
+#else
+    #define sample(a, n)        ((void)0)
+    #define unsample(a, n)      ((void)0)
+    #define unsample_from(a, i) ((void)0)
+#endif
+
+// Whether arenas have to skip the inline fast paths in arena_inline.h, which
+// know nothing of stats, hardening, heap checks, sanitizers or profiling.
+#if defined(ARENA_STATS) || defined(ARENA_HARDEN) || defined(HEAP_CHECK) || defined(SANITIZED) \
+ || defined(ARENA_PROFILE)
+    #define CHECKED true
+#else
+    #define CHECKED false
+#endif
+
+// Recomputes `checked', after something it depends on changed.
+static inline void update_checked(struct arena* a)
+{
+    a->checked = CHECKED || a->reorder_every != 0 || a->waiters != NULL;
+}
 
 // Returns true if n is in the interval [low, high)
 static inline bool in_range(const void* low, const void* n, const void* high)
@@ -118,15 +232,175 @@ static inline bool in_range(const void* low, const void* n, const void* high)
     return low <= n && n < high;
 }
 
+/*
+ * Free nodes are only ever read and written through the functions below, so
+ * that ARENA_HARDEN can change how they're encoded.
+ *
+ * When hardened, a free node's guard is ARENA_GUARD_BITS mixed with a per-arena
+ * secret and the node's own address, and its `next' pointer is XORed with the
+ * secret. Forging a free node (or moving one) then takes knowing the secret,
+ * and since the guard is cleared again on allocation, finding a valid guard
+ * in an element being freed means it's already free: O(1) double-free
+ * detection.
+ *
+ * On top of that, every POISON_EVERY'th free fills the rest of the element
+ * with POISON_BYTE and flips the guard's POISONED bit. Reallocating it checks
+ * that the poison is untouched, which catches writes through dangling
+ * pointers, not just reads of them.
+ */
+#ifdef ARENA_HARDEN
+    #define POISONED 1
+
+    static inline uint64_t guard_of(struct arena* a, struct arena_node* n)
+    {
+        return (ARENA_GUARD_BITS ^ a->secret ^ (uint64_t)(uintptr_t)n) & ~(uint64_t)POISONED;
+    }
+
+    static inline bool looks_free(struct arena* a, struct arena_node* n)
+    {
+        return (n->guard & ~(uint64_t)POISONED) == guard_of(a, n);
+    }
+
+    static inline void link_free(struct arena* a, struct arena_node* n, struct arena_node* next)
+    {
+        PEEK(n, sizeof(*n));
+        n->guard = guard_of(a, n);
+        n->next  = (struct arena_node*)((uintptr_t)next ^ (uintptr_t)a->secret);
+        HIDE(n, sizeof(*n));
+    }
+
+    static inline struct arena_node* next_free(struct arena* a, struct arena_node* n)
+    {
+        PEEK(n, sizeof(*n));
+        struct arena_node* next = (struct arena_node*)((uintptr_t)n->next ^ (uintptr_t)a->secret);
+        HIDE(n, sizeof(*n));
+
+        if(next != NULL && !in_range(a->buffer, next, a->bufend))
+            error("Corrupted free list detected.");
+
+        return next;
+    }
+
+    static void check_poison(struct arena* a, struct arena_node* n)
+    {
+        const unsigned char* p = (const unsigned char*)(n + 1);
+
+        PEEK(p, a->size - sizeof(struct arena_node));
+
+        for(size_t i = 0; i < a->size - sizeof(struct arena_node); ++i)
+            if(p[i] != POISON_BYTE)
+                error("Write to previously-freed pointer detected.");
+
+        HIDE(p, a->size - sizeof(struct arena_node));
+    }
+
+    static inline void claim(struct arena* a, struct arena_node* n)
+    {
+        PEEK(n, sizeof(*n));
+
+        if(ARENA_UNLIKELY(!looks_free(a, n)))
+            error("Use of previously-freed pointer detected.");
+
+        if(n->guard & POISONED)
+            check_poison(a, n);
+
+        n->guard = 0;
+        HIDE(n, sizeof(*n));
+    }
+
+    // Called on elements about to be freed, before they're linked in.
+    static inline void check_not_free(struct arena* a, struct arena_node* n)
+    {
+        if(looks_free(a, n))
+            error("Double-free detected.");
+    }
+
+    // Called on elements just freed.
+    static inline void maybe_poison(struct arena* a, struct arena_node* n)
+    {
+        if(--a->poison_left != 0) return;
+
+        a->poison_left = POISON_EVERY;
+        memset(n + 1, POISON_BYTE, a->size - sizeof(struct arena_node));
+
+        PEEK(n, sizeof(*n));
+        n->guard |= POISONED;
+        HIDE(n, sizeof(*n));
+    }
+
+    // splitmix64, to derive new secrets from old ones.
+    static inline uint64_t mix(uint64_t x)
+    {
+        x += UINT64_C(0x9E3779B97F4A7C15);
+        x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+        x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t new_secret(struct arena* a)
+    {
+        uint64_t s = 0;
+        FILE* f = fopen("/dev/urandom", "rb");
+
+        if(f != NULL)
+        {
+            if(fread(&s, sizeof(s), 1, f) != 1) s = 0;
+            fclose(f);
+        }
+
+        // Better than nothing if there's no /dev/urandom.
+        return mix(s ^ (uint64_t)(uintptr_t)a ^ (uint64_t)clock());
+    }
+
+    // Keys the arena from scratch, so that stale nodes left behind in the
+    // buffer by a reset no longer look free.
+    static inline void rekey(struct arena* a, bool init)
+    {
+        a->secret      = init ? new_secret(a) : mix(a->secret);
+        a->poison_left = POISON_EVERY;
+    }
+#else
+    static inline void link_free(struct arena* a, struct arena_node* n, struct arena_node* next)
+    {
+        (void)a;
+        PEEK(n, sizeof(*n));
+        n->guard = ARENA_GUARD_BITS;
+        n->next  = next;
+        HIDE(n, sizeof(*n));
+    }
+
+    static inline struct arena_node* next_free(struct arena* a, struct arena_node* n)
+    {
+        (void)a;
+        PEEK(n, sizeof(*n));
+        struct arena_node* next = n->next;
+        HIDE(n, sizeof(*n));
+        return next;
+    }
+
+    static inline void claim(struct arena* a, struct arena_node* n)
+    {
+        (void)a;
+        PEEK(n, sizeof(*n));
+        if(ARENA_UNLIKELY(n->guard != ARENA_GUARD_BITS))
+            error("Use of previously-freed pointer detected.");
+        HIDE(n, sizeof(*n));
+    }
+
+    #define check_not_free(a, n)
+    #define maybe_poison(a, n)
+    #define rekey(a, init)
+#endif
+
 #ifdef HEAP_CHECK
     // Return true if the heap is ok. O(n).
     static void check_heap(struct arena* a)
     {
         size_t i = 0;
-        struct node* p = a->free_list;
+        struct arena_node* p = a->free_list;
 
         // Ensure each pointer is in [buffer, bufend)
-        for(; p != NULL; p = p->next, ++i)
+        for(; p != NULL; p = next_free(a, p), ++i)
         {
             if(i >= a->count)
                 error("Either more elements have been freed than physically "
@@ -135,15 +409,15 @@ static inline bool in_range(const void* low, const void* n, const void* high)
         }
     }
 
-    static void detect_double_free(struct node* n, struct node* free_list)
+    static void detect_double_free(struct arena* a, struct arena_node* n, struct arena_node* free_list)
     {
-        for(struct node* c = free_list; c != NULL; c = c->next)
+        for(struct arena_node* c = free_list; c != NULL; c = next_free(a, c))
             if(c == n)
                 error("Double-free detected.");
     }
 #else
     #define check_heap(x)
-    #define detect_double_free(x, y)
+    #define detect_double_free(x, y, z)
 #endif
 
 static inline size_t max(size_t a, size_t b)
@@ -151,105 +425,1497 @@ static inline size_t max(size_t a, size_t b)
     return a <= b ? b : a;
 }
 
+// Make sure we have enough room for underlying heap data.
+static inline size_t stride(size_t size)
+{
+    return max(size, sizeof(struct arena_node));
+}
+
+static inline bool is_pow2(size_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+// Rounds n up to a multiple of `align', which must be a power of two.
+static inline size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+// How far the buffer has to be aligned: isolating the header means keeping
+// it off the buffer's first cache line.
+static inline size_t buffer_align(size_t align, bool isolate)
+{
+    return isolate ? max(align, CACHE_LINE) : align;
+}
+
+size_t arena_footprint(size_t size, size_t count)
+{
+    return arena_footprint_aligned(size, count, 1, false);
+}
+
+size_t arena_footprint_aligned(size_t size, size_t count, size_t align, bool isolate)
+{
+    return sizeof(struct arena) + buffer_align(align, isolate) - 1
+         + round_up(stride(size), align)*count;
+}
+
 struct arena* arena_init(size_t size, size_t count)
 {
-    // Make sure we have enough room for underlying heap data.
-    size = max(size, sizeof(struct node*));
+    return arena_init_aligned(size, count, 1, false);
+}
+
+struct arena* arena_init_(size_t size, size_t count, void* mem, size_t len)
+{
+    return arena_init_aligned_(size, count, 1, false, mem, len);
+}
+
+static void* heap_alloc(void* ctx, size_t len)
+{
+    (void)ctx;
+    return ALLOC(len);
+}
+
+static void heap_free(void* ctx, void* p, size_t len)
+{
+    (void)ctx;
+    (void)len;
+    FREE(p);
+}
+
+const struct arena_backing arena_heap_backing = { heap_alloc, heap_free, NULL };
+
+// Elements of the parent arena in `ctx' hold whole child arenas.
+static void* parent_alloc(void* ctx, size_t len)
+{
+    struct arena* parent = ctx;
+
+    // Headers don't fit in misaligned elements: 8 is struct arena's alignment.
+    if(len > parent->size || (parent->size | (uintptr_t)parent->buffer) % 8 != 0)
+        return NULL;
+
+    return arena_alloc(parent);
+}
+
+static void parent_free(void* ctx, void* p, size_t len)
+{
+    (void)len;
+    arena_free(ctx, p);
+}
+
+struct arena_backing arena_backing_of(struct arena* parent)
+{
+    return (struct arena_backing) { parent_alloc, parent_free, parent };
+}
+
+struct arena* arena_init_with(size_t size, size_t count, const struct arena_backing* backing)
+{
+    return arena_init_aligned_with(size, count, 1, false, backing);
+}
+
+struct arena* arena_init_aligned(size_t size, size_t count, size_t align, bool isolate)
+{
+    return arena_init_aligned_with(size, count, align, isolate, &arena_heap_backing);
+}
 
-    size_t allocated = sizeof(struct arena) + count*size;
+struct arena* arena_init_aligned_with(size_t size, size_t count, size_t align,
+                                      bool isolate, const struct arena_backing* backing)
+{
+    if(!is_pow2(align))
+        return NULL;
 
-    void* buf = ALLOC(allocated);
+    size_t allocated = arena_footprint_aligned(size, count, align, isolate);
+
+    void* buf = backing->alloc(backing->ctx, allocated);
     if(buf == NULL) return NULL;
 
-    return arena_init_(size, count, buf, allocated);
+    struct arena* a = arena_init_aligned_(size, count, align, isolate, buf, allocated);
+
+    if(a == NULL)
+    {
+        backing->free(backing->ctx, buf, allocated);
+        return NULL;
+    }
+
+    a->backing = *backing;
+    a->backed  = allocated;
+
+    return a;
 }
 
-struct arena* arena_init_(size_t size, size_t count, void* mem, size_t len)
+struct arena* arena_init_aligned_(size_t size, size_t count, size_t align,
+                                  bool isolate, void* mem, size_t len)
 {
-    // Make sure we have enough room for underlying heap data.
-    size = max(size, sizeof(struct node*));
+    if(!is_pow2(align))
+        return NULL;
 
-    if(len < sizeof(struct arena) + size*count)
+    size = round_up(stride(size), align);
+
+    // The padding actually needed depends on where `mem' is, so this can
+    // succeed with less than arena_footprint_aligned bytes.
+    uintptr_t start = round_up((uintptr_t)mem + sizeof(struct arena),
+                               buffer_align(align, isolate));
+    size_t pad = start - (uintptr_t)mem;
+
+    if(len < pad || (count != 0 && (len - pad)/size < count))
         return NULL;
 
-    struct arena* a   = mem;
-    struct node*  buf = (struct node*)((char*)mem + sizeof(struct arena));
+    struct arena*      a   = mem;
+    struct arena_node* buf = (struct arena_node*)start;
 
     *a = (struct arena) {
         .size      = size,
         .count     = count,
-        .lazy_init = true,
+        .checked   = CHECKED,
         .free_list = NULL,
         .bufstart  = buf,
         .buffer    = buf,
-        .bufend    = (struct node*)((char*)buf + count*size)
+        .bufend    = (struct arena_node*)((char*)buf + count*size),
+        .touched   = buf,
+        .atomic_list = 0,
+        .reorder_every = 0,
+        .reorder_left  = 0
     };
 
+    STAT(memset(&a->stats, 0, sizeof(a->stats)));
+    rekey(a, true);
+
+#ifdef ARENA_PROFILE
+    a->sample_left = arena_profile_next();
+#endif
+
+    POOL_CREATE(a);
+    HIDE(buf, count*size);
+
     return a;
 }
 
+// Raises `touched' to bufstart, ahead of bufstart moving down.
+static inline void note_touched(struct arena* a)
+{
+    // The atomic variants can leave bufstart past bufend.
+    struct arena_node* top = a->bufstart < a->bufend ? a->bufstart : a->bufend;
+
+    if(top > a->touched)
+        a->touched = top;
+}
+
+// Forgets which elements arena_trim handed back to the OS, for when they're
+// all in the bump region again.
+static inline void drop_released(struct arena* a)
+{
+    FREE(a->released);
+    a->released      = NULL;
+    a->released_left = 0;
+}
+
+static void serve_waiters(struct arena* a); // With arena_alloc_async.
+
 void arena_reset(struct arena* a)
 {
     check_heap(a);
 
-    a->lazy_init = true;
+    STAT(a->stats.discarded = a->stats.allocs - a->stats.frees);
+
+    note_touched(a);
+    drop_released(a);
+
+    POOL_KEEP(a, 0);
+    HIDE(a->buffer, (size_t)((char*)a->touched - (char*)a->buffer));
+    unsample_from(a, 0);
+
     a->bufstart  = a->buffer;
     a->free_list = NULL;
+    a->atomic_list = 0;
+    a->remote_list = NULL;
+    ++a->pops;
+    rekey(a, false);
     // a->bufend never changes. Leave it alone.
+
+    if(a->region != NULL)
+        region_reset(a->region);
+
+    serve_waiters(a);
 }
 
 // Returns the value, then sets it to something else.
-static inline struct node* ret_and_set(struct node** n, void* v)
+static inline struct arena_node* ret_and_set(struct arena_node** n, void* v)
 {
-    struct node* r = *n;
+    struct arena_node* r = *n;
     *n = v;
     return r;
 }
 
-// Unlinks a node from a free list and returns it.
-static void* recycle(struct node** free_list)
+// Unlinks the head of the (non-empty) free list and returns it.
+static inline void* recycle(struct arena* a)
 {
-    // Oh no we're out of recyclable elements!
-    if(*free_list == NULL) return NULL;
+    struct arena_node* n = a->free_list;
 
-    if((*free_list)->guard != GUARD_BITS)
-        error("Use of previously-freed pointer detected.");
+    a->free_list = next_free(a, n);
+    PREFETCH(a->free_list);
+    ++a->pops;
+    claim(a, n);
+
+    return n;
+}
+
+// Hands out the lowest element arena_trim handed back to the OS. There must
+// be one.
+static void* unrelease(struct arena* a)
+{
+    size_t w = a->released_hint = first_nonzero(a->released, a->released_hint,
+                                                words_for(a->count));
+    size_t i = w*64 + lowest_bit(a->released[w]);
 
-    return ret_and_set(free_list, (*free_list)->next);
+    // Clear the lowest set bit.
+    a->released[w] &= a->released[w] - 1;
+
+    if(--a->released_left == 0)
+        drop_released(a);
+
+    ++a->pops;
+    STAT(++a->stats.bumped);
+    return (char*)a->buffer + i*a->size;
 }
 
+// Hands out the next untouched element, once the free list is empty.
 static inline void* lazy_alloc(struct arena* a)
 {
-    return a->bufstart == a->bufend ? ((a->lazy_init = false), recycle(&a->free_list))
-                                    : ret_and_set(&a->bufstart, (char*)a->bufstart + a->size);
-    //                                ^--                 a->bufstart++                   --^
+    if(ARENA_UNLIKELY(a->bufstart == a->bufend))
+    {
+        // Oh no we're out of elements!
+        if(a->released == NULL) return NULL;
+
+        return unrelease(a);
+    }
+
+    STAT(++a->stats.bumped);
+    return ret_and_set(&a->bufstart, (char*)a->bufstart + a->size);
+    //                 ^--        a->bufstart++         --^
+}
+
+#ifdef ARENA_STATS
+    // Counts `n' successful allocations, and whether any failed.
+    static inline void count_allocs(struct arena* a, size_t n, bool failed)
+    {
+        a->stats.allocs += n;
+        a->stats.failed += failed;
+
+        size_t live = a->stats.allocs - a->stats.frees - a->stats.discarded;
+        if(live > a->stats.peak)
+            a->stats.peak = live;
+    }
+#else
+    #define count_allocs(a, n, failed)
+#endif
+
+// Unparks the oldest waiter and hands it `p'.
+static void serve(struct arena* a, void* p)
+{
+    struct arena_waiter* w = a->waiters;
+
+    if((a->waiters = w->next) == NULL)
+    {
+        a->last_waiter = NULL;
+        update_checked(a);
+    }
+
+    // Everything's consistent again before `ready' gets to see the arena.
+    w->ready(w->ctx, p);
+}
+
+// Pushes `n', which is known to be in range, onto the free list, unless
+// somebody's waiting for it.
+static inline void push_free(struct arena* a, struct arena_node* n)
+{
+    // O(1) for any element ASan can tell has been taken back.
+    if(ARENA_UNLIKELY(IS_HIDDEN(n)))
+        error("Double-free detected.");
+
+    detect_double_free(a, n, a->free_list);
+    check_not_free(a, n);
+
+    STAT(++a->stats.frees);
+    unsample(a, n);
+
+    if(ARENA_UNLIKELY(a->waiters != NULL))
+    {
+        count_allocs(a, 1, false);
+        sample(a, n);
+        serve(a, n);
+        return;
+    }
+
+    link_free(a, n, a->free_list);
+    maybe_poison(a, n);
+    take_back(a, n);
+    a->free_list = n;
+}
+
+// Moves everything arena_free_remote pushed onto the free list, in one go.
+static void drain_remote(struct arena* a)
+{
+    // Only a load while there's nothing to drain, to keep the line shared.
+    if(__atomic_load_n(&a->remote_list, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    struct arena_node* c = __atomic_exchange_n(&a->remote_list, NULL,
+                                               __ATOMIC_ACQUIRE);
+    check_heap(a);
+
+    for(struct arena_node* next; c != NULL; c = next)
+    {
+        next = c->next;
+        push_free(a, c);
+    }
 }
 
 void* arena_alloc(struct arena* a)
 {
-    return a->lazy_init ? lazy_alloc(a)
-                        : recycle(&a->free_list);
+    // Remote frees go before the bump region, so they don't pile up unused.
+    if(ARENA_UNLIKELY(a->free_list == NULL))
+        drain_remote(a);
+
+    void* p = ARENA_LIKELY(a->free_list != NULL) ? recycle(a)
+                                                 : lazy_alloc(a);
+    if(p != NULL)
+    {
+        hand_out(a, p);
+        sample(a, p);
+    }
+
+    count_allocs(a, p != NULL, p == NULL);
+    return p;
 }
 
 void arena_free(struct arena* a, void* p)
 {
-    struct node* n = p;
+    struct arena_node* n = p;
 
-    if(n == NULL) return;
+    if(ARENA_UNLIKELY(n == NULL)) return;
 
-    if(!in_range(a->buffer, p, a->bufend))
+    if(ARENA_UNLIKELY(!in_range(a->buffer, p, a->bufend)))
         error("Trying to free a pointer which was not allocated in this arena.");
 
     check_heap(a);
-    detect_double_free(p, a->free_list);
+    push_free(a, n);
 
-    n->guard = GUARD_BITS;
-    n->next = a->free_list;
-    a->free_list = n;
+    if(ARENA_UNLIKELY(a->reorder_left != 0) && --a->reorder_left == 0)
+    {
+        arena_reorder(a);
+        a->reorder_left = a->reorder_every;
+    }
 }
 
-void arena_destroy(struct arena* a)
+// Whether arena_alloc would succeed, remote frees aside.
+static inline bool available(struct arena* a)
 {
-    check_heap(a);
-    FREE(a);
+    return a->free_list != NULL || a->bufstart < a->bufend || a->released != NULL;
+}
+
+// Hands out elements to waiters for as long as there are both.
+static void serve_waiters(struct arena* a)
+{
+    while(ARENA_UNLIKELY(a->waiters != NULL) && available(a))
+        serve(a, arena_alloc(a));
+}
+
+void* arena_alloc_async(struct arena* a, struct arena_waiter* w)
+{
+    // Remote frees go to whoever's already waiting.
+    drain_remote(a);
+
+    if(a->waiters == NULL && available(a))
+        return arena_alloc(a);
+
+    w->next = NULL;
+
+    if(a->last_waiter != NULL)
+        a->last_waiter->next = w;
+    else
+        a->waiters = w;
+
+    a->last_waiter = w;
+    update_checked(a);
+
+    return NULL;
+}
+
+bool arena_cancel_async(struct arena* a, struct arena_waiter* w)
+{
+    struct arena_waiter* prev = NULL;
+
+    for(struct arena_waiter** c = &a->waiters; *c != NULL; prev = *c, c = &(*c)->next)
+        if(*c == w)
+        {
+            *c = w->next;
+
+            if(a->last_waiter == w)
+                a->last_waiter = prev;
+
+            update_checked(a);
+            return true;
+        }
+
+    return false;
+}
+
+void arena_free_remote(struct arena* a, void* p)
+{
+    struct arena_node* n = p;
+
+    if(n == NULL) return;
+
+    // The buffer bounds never change, so this is safe from any thread.
+    if(!in_range(a->buffer, p, a->bufend))
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    struct arena_node* head = __atomic_load_n(&a->remote_list, __ATOMIC_RELAXED);
+
+    // Nothing ever pops a single node off remote_list, only the whole list at
+    // once, so unlike the atomic variants there's no ABA to guard against.
+    do {
+        n->next = head;
+    } while(!__atomic_compare_exchange_n(&a->remote_list, &head, n,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+size_t arena_alloc_n(struct arena* a, void** out, size_t n)
+{
+    size_t i = 0;
+
+    drain_remote(a);
+
+    // Splice as much as we can off the head of the free list in one go...
+    struct arena_node* c = a->free_list;
+
+    for(; i < n && c != NULL; ++i)
+    {
+        struct arena_node* next = next_free(a, c);
+
+        claim(a, c);
+        out[i] = c;
+        c = next;
+    }
+
+    a->free_list = c;
+    a->pops     += i;
+
+    // ...then carve a contiguous run off the bump region for the rest.
+    if(i < n)
+    {
+        size_t left = (size_t)((char*)a->bufend - (char*)a->bufstart) / a->size;
+        size_t run  = n - i < left ? n - i : left;
+        char*  p    = (char*)a->bufstart;
+
+        for(size_t j = 0; j < run; ++j, p += a->size)
+            out[i++] = p;
+
+        a->bufstart = (struct arena_node*)p;
+        STAT(a->stats.bumped += run);
+    }
+
+    while(i < n && a->released != NULL)
+        out[i++] = unrelease(a);
+
+    for(size_t j = 0; j < i; ++j)
+    {
+        hand_out(a, out[j]);
+        sample(a, out[j]);
+    }
+
+    count_allocs(a, i, i < n);
+    return i;
+}
+
+void arena_free_n(struct arena* a, void** p, size_t n)
+{
+    struct arena_node* head = a->free_list;
+
+    // Waiters get the elements one by one, in order.
+    if(ARENA_UNLIKELY(a->waiters != NULL))
+    {
+        for(size_t i = 0; i < n; ++i)
+            arena_free(a, p[i]);
+
+        return;
+    }
+
+    check_heap(a);
+
+    // Link the nodes back to front so the list ends up in the order given, and
+    // only publish the new head once the whole chain is built.
+    for(size_t i = n; i-- > 0;)
+    {
+        struct arena_node* c = p[i];
+
+        if(c == NULL) continue;
+
+        if(!in_range(a->buffer, c, a->bufend))
+            error("Trying to free a pointer which was not allocated in this arena.");
+
+        if(IS_HIDDEN(c))
+            error("Double-free detected.");
+
+        detect_double_free(a, c, head);
+        check_not_free(a, c);
+
+        STAT(++a->stats.frees);
+        unsample(a, c);
+
+        link_free(a, c, head);
+        maybe_poison(a, c);
+        take_back(a, c);
+        head = c;
+    }
+
+    a->free_list = head;
+}
+
+void arena_attach_region(struct arena* a, struct region* r)
+{
+    if(a->region != NULL && a->region != r)
+        region_destroy(a->region);
+
+    a->region = r;
+}
+
+void* arena_alloc_bytes(struct arena* a, size_t n, size_t align)
+{
+    return a->region != NULL ? region_alloc(a->region, n, align) : NULL;
+}
+
+struct arena_mark arena_mark(struct arena* a)
+{
+    return (struct arena_mark) {
+        .bufstart  = a->bufstart,
+        .free_list = a->free_list,
+        .pops      = a->pops
+    };
+}
+
+bool arena_rollback_to(struct arena* a, struct arena_mark m)
+{
+    struct arena_node* start = (struct arena_node*)m.bufstart;
+
+    // A pop can't be undone: the element's free list link is gone.
+    if(m.pops != a->pops || start > a->bufstart)
+        return false;
+
+    // Remote frees above the mark are about to go back into the bump region,
+    // so they can't stay queued.
+    drain_remote(a);
+    check_heap(a);
+
+    // The free list is everything freed since the mark, newest first, in
+    // front of the free list at the mark. Elements from above the mark's
+    // bufstart go back into the bump region; the rest stay free.
+    struct arena_node *head = NULL, *prev = NULL, *prev_next = NULL;
+    size_t dropped = 0;
+
+    for(struct arena_node *c = a->free_list, *next; c != m.free_list; c = next)
+    {
+        // Only a mark taken after one we've rolled back to gets us here.
+        if(c == NULL)
+            error("Rollback to a mark which is no longer valid.");
+
+        next = next_free(a, c);
+
+        if(c >= start)
+        {
+            // Once back in the bump region, they must not look free anymore.
+            claim(a, c);
+            ++dropped;
+            continue;
+        }
+
+        if(prev == NULL)
+            head = c;
+        else if(prev_next != c)
+            link_free(a, prev, c);
+
+        prev      = c;
+        prev_next = next;
+    }
+
+    if(prev == NULL)
+        head = m.free_list;
+    else if(prev_next != m.free_list)
+        link_free(a, prev, m.free_list);
+
+    // Everything bumped since the mark and not freed yet is freed implicitly.
+    STAT(a->stats.discarded += (size_t)((char*)a->bufstart - (char*)start) / a->size
+                             - dropped);
+    (void)dropped;
+
+    note_touched(a);
+    POOL_KEEP(a, (size_t)((char*)start - (char*)a->buffer));
+    HIDE(start, (size_t)((char*)a->bufstart - (char*)start));
+    unsample_from(a, (size_t)((char*)start - (char*)a->buffer) / a->size);
+
+    a->free_list = head;
+    a->bufstart  = start;
+
+    serve_waiters(a);
+    return true;
+}
+
+// Returns the index of `n' in the buffer.
+static inline size_t index_of(struct arena* a, struct arena_node* n)
+{
+    return (size_t)((char*)n - (char*)a->buffer) / a->size;
+}
+
+static inline struct arena_node* nth(struct arena* a, size_t i)
+{
+    return (struct arena_node*)((char*)a->buffer + i*a->size);
+}
+
+// The number of elements which have ever left the bump region.
+static inline size_t bumped(struct arena* a)
+{
+    // The atomic variants can leave bufstart past bufend.
+    return a->bufstart < a->bufend ? index_of(a, a->bufstart) : a->count;
+}
+
+// Sets bit i of `bm' (which must start out zeroed) for every element i on the
+// free list. O(free).
+static void mark_free(struct arena* a, uint64_t* bm)
+{
+    for(struct arena_node* c = a->free_list; c != NULL; c = next_free(a, c))
+    {
+        size_t i = index_of(a, c);
+        bm[i/64] |= UINT64_C(1) << i % 64;
+    }
+}
+
+// Returns a bitmap with bit i set iff element i is on the free list, or NULL
+// if it couldn't be allocated. O(count). Free it with FREE.
+static uint64_t* free_bitmap(struct arena* a)
+{
+    size_t words = words_for(bumped(a));
+    uint64_t* bm = ALLOC(words*sizeof(uint64_t) + 1); // Never ALLOC(0).
+    if(bm == NULL) return NULL;
+
+    memset(bm, 0, words*sizeof(uint64_t));
+    mark_free(a, bm);
+
+    return bm;
+}
+
+void arena_reorder(struct arena* a)
+{
+    drain_remote(a);
+    check_heap(a);
+
+    uint64_t* bm = free_bitmap(a);
+    if(bm == NULL) return;
+
+    // Free elements right below the bump region go back into it...
+    size_t top = bumped(a);
+
+    while(top > 0 && test_bit(bm, top - 1))
+        --top;
+
+    if(top != bumped(a))
+    {
+        // Once back in the bump region, they must not look free anymore.
+        for(size_t i = top; i < bumped(a); ++i)
+            claim(a, nth(a, i));
+
+        note_touched(a);
+        a->bufstart = nth(a, top);
+    }
+
+    // ...and the rest are relinked lowest address first.
+    a->free_list = NULL;
+    ++a->pops;
+
+    for(size_t i = top; i-- > 0;)
+    {
+        if(!test_bit(bm, i)) continue;
+
+        struct arena_node* n = nth(a, i);
+        link_free(a, n, a->free_list);
+        a->free_list = n;
+    }
+
+    FREE(bm);
+}
+
+void arena_set_reorder(struct arena* a, size_t every)
+{
+    a->reorder_every = a->reorder_left = every;
+    update_checked(a);
+}
+
+static inline bool is_released(struct arena* a, size_t i)
+{
+    return a->released != NULL && test_bit(a->released, i);
+}
+
+// Whether element i is free, whether on the free list (according to `bm') or
+// handed back to the OS.
+static inline bool is_free(struct arena* a, const uint64_t* bm, size_t i)
+{
+    return test_bit(bm, i) || is_released(a, i);
+}
+
+// Whether the page at `p', which lies below element `top', should be handed
+// back: every element on it is free, and it isn't all handed back already.
+static bool releasable(struct arena* a, const uint64_t* bm, char* p)
+{
+    size_t first = index_of(a, (struct arena_node*)p);
+    size_t last  = index_of(a, (struct arena_node*)(p + PAGE - 1));
+    bool   fresh = false;
+
+    for(size_t i = first; i <= last; ++i)
+    {
+        if(!is_free(a, bm, i)) return false;
+        fresh |= !is_released(a, i);
+    }
+
+    return fresh;
+}
+
+// Hands back the pages above both `from' and bufstart which have been
+// touched since the last time.
+static size_t release_tail(struct arena* a, void* from)
+{
+    note_touched(a);
+
+    if((char*)from < (char*)a->bufstart)
+        from = a->bufstart;
+
+    if((char*)from >= (char*)a->touched)
+        return 0;
+
+    // The page holding `touched' can be handed back whole, as long as it's
+    // inside the buffer.
+    uintptr_t end = ((uintptr_t)a->touched + PAGE - 1) & ~(uintptr_t)(PAGE - 1);
+    if(end > (uintptr_t)a->bufend)
+        end = (uintptr_t)a->bufend;
+
+    a->touched = from;
+    return release_pages(from, (void*)end);
+}
+
+size_t arena_trim(struct arena* a)
+{
+    drain_remote(a);
+    check_heap(a);
+
+    uint64_t* bm = free_bitmap(a);
+    if(bm == NULL) return 0;
+
+    // Free elements right below the bump region go back into it...
+    size_t top = bumped(a);
+
+    while(top > 0 && is_free(a, bm, top - 1))
+        --top;
+
+    // ...and so do whole pages of free elements below that, as far as the
+    // free list is concerned. Their elements are marked in `released' instead
+    // and handed out once both the free list and the bump region run dry.
+    char* lo = (char*)(((uintptr_t)a->buffer + PAGE - 1) & ~(uintptr_t)(PAGE - 1));
+    char* hi = (char*)nth(a, top);
+
+    if(a->released == NULL && lo + PAGE <= hi)
+    {
+        a->released = ALLOC(words_for(a->count)*sizeof(uint64_t) + 1); // Never ALLOC(0).
+
+        if(a->released != NULL)
+            memset(a->released, 0, words_for(a->count)*sizeof(uint64_t));
+    }
+
+    for(char* p = lo; a->released != NULL && p + PAGE <= hi; p += PAGE)
+    {
+        if(!releasable(a, bm, p)) continue;
+
+        size_t last = index_of(a, (struct arena_node*)(p + PAGE - 1));
+
+        for(size_t i = index_of(a, (struct arena_node*)p); i <= last; ++i)
+            if(!is_released(a, i))
+            {
+                a->released[i/64] |= UINT64_C(1) << i % 64;
+                ++a->released_left;
+            }
+    }
+
+    // Released elements above `top' are back in the bump region.
+    for(size_t i = top; i < bumped(a); ++i)
+        if(is_released(a, i))
+        {
+            a->released[i/64] &= ~(UINT64_C(1) << i % 64);
+            --a->released_left;
+        }
+
+    // Unlink everything that moved, before its memory goes away.
+    struct arena_node *head = NULL, *prev = NULL, *prev_next = NULL;
+
+    for(struct arena_node *c = a->free_list, *next; c != NULL; c = next)
+    {
+        size_t i = index_of(a, c);
+        next = next_free(a, c);
+
+        if(i >= top || is_released(a, i))
+        {
+            // Once out of the free list, they must not look free anymore.
+            claim(a, c);
+            continue;
+        }
+
+        // Only relink where something was taken out.
+        if(prev == NULL)
+            head = c;
+        else if(prev_next != c)
+            link_free(a, prev, c);
+
+        prev      = c;
+        prev_next = next;
+    }
+
+    if(prev != NULL && prev_next != NULL)
+        link_free(a, prev, NULL);
+
+    a->free_list = head;
+    a->released_hint = 0;
+    ++a->pops;
+
+    if(a->released != NULL && a->released_left == 0)
+        drop_released(a);
+
+    note_touched(a);
+    a->bufstart = nth(a, top);
+
+    // Now hand back the pages with nothing but released elements on them,
+    // some of which were only just released...
+    size_t bytes = 0;
+    char*  run   = NULL;
+
+    for(char* p = lo; p + PAGE <= hi; p += PAGE)
+    {
+        bool all = true, fresh = false;
+
+        for(size_t i = index_of(a, (struct arena_node*)p),
+                last = index_of(a, (struct arena_node*)(p + PAGE - 1));
+            i <= last && all; ++i)
+        {
+            all   = is_released(a, i);
+            fresh |= test_bit(bm, i);
+        }
+
+        all = all && fresh;
+
+        if(all && run == NULL) run = p;
+        if(!all && run != NULL)
+        {
+            bytes += release_pages(run, p);
+            run = NULL;
+        }
+    }
+
+    if(run != NULL)
+        bytes += release_pages(run, hi);
+
+    FREE(bm);
+
+    // ...and the top of the buffer.
+    return bytes + release_tail(a, a->bufstart);
+}
+
+size_t arena_reset_retain(struct arena* a, size_t retain)
+{
+    arena_reset(a);
+
+    size_t len = (size_t)((char*)a->bufend - (char*)a->buffer);
+    return release_tail(a, (char*)a->buffer + (retain < len ? retain : len));
+}
+
+struct arena_locality arena_locality(struct arena* a)
+{
+    drain_remote(a);
+
+    struct arena_locality l = { 0, 0, 0 };
+    size_t per_page = a->size < PAGE ? PAGE / a->size : 1;
+
+    struct arena_node* prev = NULL;
+
+    for(struct arena_node* c = a->free_list; c != NULL; prev = c, c = next_free(a, c))
+    {
+        ++l.free;
+
+        if(prev != NULL && index_of(a, prev)/per_page != index_of(a, c)/per_page)
+            ++l.jumps;
+    }
+
+    // An address-ordered list only jumps once per extra page it spans.
+    uint64_t* bm = free_bitmap(a);
+    if(bm == NULL) return l;
+
+    size_t pages = 0, last = SIZE_MAX;
+
+    for(size_t i = 0; i < bumped(a); ++i)
+        if(test_bit(bm, i) && i/per_page != last)
+        {
+            last = i/per_page;
+            ++pages;
+        }
+
+    l.min_jumps = pages == 0 ? 0 : pages - 1;
+
+    FREE(bm);
+    return l;
+}
+
+struct arena_live {
+    char*  buffer; // The arena's buffer.
+    size_t size;   // The size of each element.
+    size_t slots;  // The number of elements that have ever been allocated.
+    uint64_t free[]; // Bit i is set iff element i is free.
+};
+
+struct arena_live* arena_live_map(struct arena* a)
+{
+    drain_remote(a);
+    check_heap(a);
+
+    size_t slots = bumped(a);
+    size_t words = words_for(slots);
+
+    struct arena_live* m = ALLOC(sizeof(struct arena_live) + words*sizeof(uint64_t));
+    if(m == NULL) return NULL;
+
+    m->buffer = (char*)a->buffer;
+    m->size   = a->size;
+    m->slots  = slots;
+
+    memset(m->free, 0, words*sizeof(uint64_t));
+    mark_free(a, m->free);
+
+    if(a->released != NULL)
+        for(size_t i = 0; i < words; ++i)
+            m->free[i] |= a->released[i];
+
+    return m;
+}
+
+size_t arena_live_slots(const struct arena_live* m)
+{
+    return m->slots;
+}
+
+void arena_live_visit(const struct arena_live* m, size_t begin, size_t end,
+                      arena_visitor fn, void* ctx)
+{
+    if(end > m->slots) end = m->slots;
+
+    if(begin < end)
+        visit_clear(m->free, begin, end, m->buffer, m->size, fn, ctx);
+}
+
+void arena_live_destroy(struct arena_live* m)
+{
+    FREE(m);
+}
+
+bool arena_foreach_live(struct arena* a, arena_visitor fn, void* ctx)
+{
+    struct arena_live* m = arena_live_map(a);
+    if(m == NULL) return false;
+
+    arena_live_visit(m, 0, m->slots, fn, ctx);
+    arena_live_destroy(m);
+
+    return true;
+}
+
+/*
+ * A snapshot is a header, the indices of the free elements (the free list in
+ * order, then the elements arena_trim handed back), and a table of runs: byte
+ * ranges of the used part of the buffer, as offsets and lengths, followed by
+ * their contents. A full snapshot has one run covering everything; a dirty
+ * one has a run per stretch of soft-dirty pages. Restoring either is the
+ * same: copy the runs in, then relink the free list from the indices.
+ *
+ * Soft-dirty bits are read from /proc/self/pagemap (bit 55 of each page's
+ * entry) and cleared by writing "4" to /proc/self/clear_refs. Kernels built
+ * without them take the write but never set the bit, so clearing them is
+ * checked by dirtying a page of our own and looking for it.
+ */
+#define SNAPSHOT_MAGIC   UINT64_C(0x504E53414E455241) // "ARENASNP", little-endian.
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BATCH   64 // iovecs per writev.
+
+struct snapshot_header {
+    uint64_t magic, version;
+    uint64_t size, count;
+    uint64_t bumped; // Elements at the bottom of the buffer not in the bump region.
+    uint64_t free;   // Indices of free elements.
+    uint64_t runs;   // Runs of buffer contents.
+};
+
+// Buffers up iovecs, and writes them out SNAPSHOT_BATCH at a time.
+struct snapshot_out {
+    int          fd;
+    bool         ok;
+    int          n;
+    struct iovec iov[SNAPSHOT_BATCH];
+};
+
+static void flush_out(struct snapshot_out* o)
+{
+    struct iovec* iov = o->iov;
+    int n = o->n;
+
+    o->n = 0;
+
+    while(o->ok && n > 0)
+    {
+        ssize_t w = writev(o->fd, iov, n);
+
+        if(w < 0)
+        {
+            o->ok = errno == EINTR;
+            continue;
+        }
+
+        // Skip whatever made it out, which may end partway into an iovec.
+        size_t got = (size_t)w;
+
+        for(; n > 0 && got >= iov->iov_len; ++iov, --n)
+            got -= iov->iov_len;
+
+        if(n > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + got;
+            iov->iov_len -= got;
+        }
+    }
+}
+
+static void put_out(struct snapshot_out* o, const void* p, size_t len)
+{
+    if(len == 0) return;
+
+    o->iov[o->n++] = (struct iovec) { .iov_base = (void*)p, .iov_len = len };
+
+    if(o->n == SNAPSHOT_BATCH)
+        flush_out(o);
+}
+
+static bool read_all(int fd, void* p, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t r = read(fd, p, len);
+
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+
+        p    = (char*)p + r;
+        len -= (size_t)r;
+    }
+
+    return true;
+}
+
+// Whether the page holding `p' is soft-dirty, according to `pagemap'.
+static bool soft_dirty(int pagemap, const volatile void* p)
+{
+    uint64_t e;
+    off_t at = (off_t)((uintptr_t)p / PAGE * sizeof(uint64_t));
+
+    return pread(pagemap, &e, sizeof(e), at) == (ssize_t)sizeof(e) && (e >> 55 & 1);
+}
+
+static volatile char probe[PAGE];
+
+bool arena_track_dirty(void)
+{
+    int clear   = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    bool ok = clear >= 0 && pagemap >= 0 && write(clear, "4", 1) == 1;
+
+    // Only a write makes it dirty, and it must show up.
+    probe[0] = 1;
+    ok = ok && soft_dirty(pagemap, probe);
+
+    if(clear >= 0)   close(clear);
+    if(pagemap >= 0) close(pagemap);
+
+    return ok;
+}
+
+// Fills `runs' with (offset, length) pairs covering the first `used' bytes of
+// the buffer which lie on soft-dirty pages, merging neighbours. Needs room
+// for used/PAGE/2 + 2 pairs (every other page, plus two partial ones).
+// Returns the number of pairs, or SIZE_MAX if the page map couldn't be read.
+static size_t dirty_runs(struct arena* a, size_t used, uint64_t* runs)
+{
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if(pagemap < 0) return SIZE_MAX;
+
+    uintptr_t buf   = (uintptr_t)a->buffer;
+    uintptr_t base  = buf & ~(uintptr_t)(PAGE - 1);
+    uintptr_t end   = buf + used;
+    size_t    pages = used == 0 ? 0 : (end - base + PAGE - 1) / PAGE;
+    size_t    n     = 0;
+    uint64_t  e[512];
+
+    for(size_t i = 0; i < pages; i += 512)
+    {
+        size_t m  = pages - i < 512 ? pages - i : 512;
+        off_t  at = (off_t)((base / PAGE + i) * sizeof(uint64_t));
+
+        if(pread(pagemap, e, m*sizeof(uint64_t), at) != (ssize_t)(m*sizeof(uint64_t)))
+        {
+            close(pagemap);
+            return SIZE_MAX;
+        }
+
+        for(size_t j = 0; j < m; ++j)
+        {
+            if(!(e[j] >> 55 & 1)) continue;
+
+            uintptr_t lo = base + (i + j)*PAGE, hi = lo + PAGE;
+            if(lo < buf) lo = buf;
+            if(hi > end) hi = end;
+
+            if(n > 0 && runs[2*n - 2] + runs[2*n - 1] == lo - buf)
+                runs[2*n - 1] += hi - lo;
+            else
+            {
+                runs[2*n]     = lo - buf;
+                runs[2*n + 1] = hi - lo;
+                ++n;
+            }
+        }
+    }
+
+    close(pagemap);
+    return n;
+}
+
+static bool snapshot(struct arena* a, int fd, bool dirty)
+{
+    drain_remote(a);
+    check_heap(a);
+
+    size_t slots = bumped(a);
+    size_t used  = slots*a->size;
+    size_t nfree = a->released_left;
+
+    for(struct arena_node* c = a->free_list; c != NULL; c = next_free(a, c))
+        ++nfree;
+
+    uint64_t* idx  = ALLOC(nfree*sizeof(uint64_t) + 1); // Never ALLOC(0).
+    uint64_t* runs = ALLOC((used/PAGE/2 + 2)*2*sizeof(uint64_t));
+    bool ok = idx != NULL && runs != NULL;
+
+    struct snapshot_header h = {
+        .magic   = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .size    = a->size,
+        .count   = a->count,
+        .bumped  = slots,
+        .free    = nfree
+    };
+
+    if(ok)
+    {
+        size_t k = 0;
+
+        for(struct arena_node* c = a->free_list; c != NULL; c = next_free(a, c))
+            idx[k++] = index_of(a, c);
+
+        if(a->released != NULL)
+            for(size_t w = first_nonzero(a->released, 0, words_for(a->count));
+                w < words_for(a->count); w = first_nonzero(a->released, w + 1, words_for(a->count)))
+                for(uint64_t bits = a->released[w]; bits != 0; bits &= bits - 1)
+                    idx[k++] = w*64 + lowest_bit(bits);
+
+        if(!dirty)
+        {
+            runs[0] = 0;
+            runs[1] = used;
+            h.runs  = used != 0;
+        }
+        else if((h.runs = dirty_runs(a, used, runs)) == SIZE_MAX || !arena_track_dirty())
+            ok = false;
+    }
+
+    if(ok)
+    {
+        struct snapshot_out o = { .fd = fd, .ok = true };
+
+        // Free elements are hidden from the sanitizers, and go out too.
+        PEEK(a->buffer, used);
+
+        put_out(&o, &h, sizeof(h));
+        put_out(&o, idx, nfree*sizeof(uint64_t));
+        put_out(&o, runs, h.runs*2*sizeof(uint64_t));
+
+        for(size_t i = 0; i < h.runs; ++i)
+            put_out(&o, (char*)a->buffer + runs[2*i], runs[2*i + 1]);
+
+        flush_out(&o);
+        ok = o.ok;
+
+        for(size_t i = 0; i < nfree; ++i)
+            HIDE(nth(a, idx[i]), a->size);
+    }
+
+    FREE(idx);
+    FREE(runs);
+
+    return ok;
+}
+
+bool arena_snapshot(struct arena* a, int fd)
+{
+    return snapshot(a, fd, false);
+}
+
+bool arena_snapshot_dirty(struct arena* a, int fd)
+{
+    return snapshot(a, fd, true);
+}
+
+bool arena_restore(struct arena* a, int fd)
+{
+    struct snapshot_header h;
+
+    if(!read_all(fd, &h, sizeof(h))
+    || h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION
+    || h.size != a->size || h.count != a->count
+    || h.bumped > h.count || h.free > h.bumped)
+        return false;
+
+    size_t slots = (size_t)h.bumped;
+    size_t used  = slots*a->size;
+
+    if(h.runs > used/PAGE/2 + 2)
+        return false;
+
+    uint64_t* idx  = ALLOC(h.free*sizeof(uint64_t) + 1); // Never ALLOC(0).
+    uint64_t* runs = ALLOC(h.runs*2*sizeof(uint64_t) + 1);
+    uint64_t* bm   = ALLOC(words_for(slots)*sizeof(uint64_t) + 1);
+    bool ok = idx != NULL && runs != NULL && bm != NULL
+           && read_all(fd, idx, h.free*sizeof(uint64_t))
+           && read_all(fd, runs, h.runs*2*sizeof(uint64_t));
+
+    // Nothing may point outside the used part, and nothing may be free twice.
+    if(ok)
+    {
+        memset(bm, 0, words_for(slots)*sizeof(uint64_t));
+
+        for(size_t i = 0; ok && i < h.free; ++i)
+        {
+            ok = idx[i] < slots && !test_bit(bm, idx[i]);
+            if(ok) bm[idx[i]/64] |= UINT64_C(1) << idx[i] % 64;
+        }
+
+        for(size_t i = 0; ok && i < h.runs; ++i)
+            ok = runs[2*i] <= used && runs[2*i + 1] <= used - runs[2*i];
+    }
+
+    if(ok)
+    {
+        // From here on, the arena's old state is gone, as if by arena_reset.
+        check_heap(a);
+
+        STAT(a->stats.discarded = a->stats.allocs - a->stats.frees);
+
+        note_touched(a);
+        drop_released(a);
+
+        POOL_KEEP(a, 0);
+        HIDE(a->buffer, (size_t)((char*)a->touched - (char*)a->buffer));
+        unsample_from(a, 0);
+
+        a->free_list   = NULL;
+        a->atomic_list = 0;
+        a->remote_list = NULL;
+        ++a->pops;
+        rekey(a, false);
+
+        // Runs are read straight into the buffer.
+        REVEAL(a->buffer, used);
+        a->bufstart = nth(a, slots);
+
+        for(size_t i = 0; ok && i < h.runs; ++i)
+            ok = read_all(fd, (char*)a->buffer + runs[2*i], runs[2*i + 1]);
+
+        // Leave it empty, as arena_reset would, but the region alone: it was
+        // never part of the snapshot.
+        if(!ok)
+        {
+            note_touched(a);
+            HIDE(a->buffer, used);
+            a->bufstart = a->buffer;
+            serve_waiters(a);
+        }
+    }
+
+    if(ok)
+    {
+        for(size_t i = h.free; i-- > 0;)
+        {
+            struct arena_node* n = nth(a, idx[i]);
+            link_free(a, n, a->free_list);
+            a->free_list = n;
+        }
+
+    #ifdef SANITIZED
+        for(size_t i = 0; i < slots; ++i)
+        {
+            if(test_bit(bm, i))
+                HIDE(nth(a, i), a->size);
+            else
+                hand_out(a, nth(a, i));
+        }
+    #endif
+
+        count_allocs(a, slots - h.free, false);
+        serve_waiters(a);
+    }
+
+    FREE(idx);
+    FREE(runs);
+    FREE(bm);
+
+    return ok;
+}
+
+/*
+ * The atomic variants keep their free list in a Treiber stack. To protect
+ * against ABA, the head isn't a pointer but a single 64-bit word holding the
+ * head's offset into the buffer in its low bits and a generation count in its
+ * high bits. Every successful push or pop bumps the generation, so a thread
+ * which read the head, got preempted, and woke up after the head was popped
+ * and pushed back again fails its CAS instead of corrupting the list.
+ *
+ * Reading `next' from a node some other thread just popped is harmless: the
+ * node still lives inside the buffer, and the CAS fails anyway since the
+ * generation has moved on.
+ */
+#define OFFSET_BITS 40
+#define OFFSET_MASK ((UINT64_C(1) << OFFSET_BITS) - 1)
+
+// Offsets are stored plus one so that an empty list is 0.
+static inline struct arena_node* tag_to_node(struct arena* a, uint64_t tag)
+{
+    uint64_t off = tag & OFFSET_MASK;
+    return off == 0 ? NULL : (struct arena_node*)((char*)a->buffer + off - 1);
+}
+
+static inline uint64_t node_to_tag(struct arena* a, struct arena_node* n, uint64_t gen)
+{
+    uint64_t off = n == NULL ? 0 : (uint64_t)((char*)n - (char*)a->buffer) + 1;
+    return ((gen >> OFFSET_BITS) + 1) << OFFSET_BITS | off;
+}
+
+void* arena_alloc_atomic(struct arena* a)
+{
+    // The bump region first. The load keeps failed allocations from pushing
+    // bufstart arbitrarily far past bufend; at most one step per racing thread.
+    if(__atomic_load_n(&a->bufstart, __ATOMIC_RELAXED) < a->bufend)
+    {
+        // GCC and clang add bytes, not elements, to atomic pointers.
+        struct arena_node* n = __atomic_fetch_add(&a->bufstart, a->size,
+                                            __ATOMIC_RELAXED);
+        if(n < a->bufend)
+        {
+            hand_out(a, n);
+            STAT(__atomic_fetch_add(&a->stats.allocs, 1, __ATOMIC_RELAXED));
+            STAT(__atomic_fetch_add(&a->stats.bumped, 1, __ATOMIC_RELAXED));
+            return n;
+        }
+    }
+
+    uint64_t head = __atomic_load_n(&a->atomic_list, __ATOMIC_ACQUIRE);
+    struct arena_node* n;
+
+    do {
+        if((n = tag_to_node(a, head)) == NULL)
+        {
+            STAT(__atomic_fetch_add(&a->stats.failed, 1, __ATOMIC_RELAXED));
+            return NULL;
+        }
+    } while(!__atomic_compare_exchange_n(&a->atomic_list, &head,
+                node_to_tag(a, __atomic_load_n(&n->next, __ATOMIC_RELAXED),
+                            head),
+                true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    // Only check the guard once the node is ours; before that, its contents
+    // may legitimately be changing under us.
+    if(n->guard != ARENA_GUARD_BITS)
+        error("Use of previously-freed pointer detected.");
+
+    STAT(__atomic_fetch_add(&a->stats.allocs, 1, __ATOMIC_RELAXED));
+    return n;
+}
+
+void arena_free_atomic(struct arena* a, void* p)
+{
+    struct arena_node* n = p;
+
+    if(ARENA_UNLIKELY(n == NULL)) return;
+
+    if(ARENA_UNLIKELY(!in_range(a->buffer, p, a->bufend)))
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    n->guard = ARENA_GUARD_BITS;
+
+    STAT(__atomic_fetch_add(&a->stats.frees, 1, __ATOMIC_RELAXED));
+
+    uint64_t head = __atomic_load_n(&a->atomic_list, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(&n->next, tag_to_node(a, head), __ATOMIC_RELAXED);
+    } while(!__atomic_compare_exchange_n(&a->atomic_list, &head,
+                node_to_tag(a, n, head),
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void arena_stats(struct arena* a, struct arena_stats* s)
+{
+#ifdef ARENA_STATS
+    size_t allocs = __atomic_load_n(&a->stats.allocs, __ATOMIC_RELAXED);
+    size_t bumped = __atomic_load_n(&a->stats.bumped, __ATOMIC_RELAXED);
+
+    *s = (struct arena_stats) {
+        .live     = allocs - __atomic_load_n(&a->stats.frees, __ATOMIC_RELAXED)
+                           - a->stats.discarded,
+        .peak     = a->stats.peak,
+        .allocs   = allocs,
+        .frees    = __atomic_load_n(&a->stats.frees, __ATOMIC_RELAXED),
+        .failed   = __atomic_load_n(&a->stats.failed, __ATOMIC_RELAXED),
+        .bumped   = bumped,
+        .recycled = allocs - bumped
+    };
+#else
+    (void)a;
+    memset(s, 0, sizeof(*s));
+#endif
+}
+
+void arena_destroy(struct arena* a)
+{
+    check_heap(a);
+    FREE(a->released);
+
+    unsample_from(a, 0);
+    FREE(a->sampled);
+
+    if(a->region != NULL)
+        region_destroy(a->region);
+
+    // The memory may be reused for anything now.
+    POOL_DESTROY(a);
+    REVEAL(a->buffer, (size_t)((char*)a->bufend - (char*)a->buffer));
+
+    if(a->backing.free != NULL)
+        a->backing.free(a->backing.ctx, a, a->backed);
 }
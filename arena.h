@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -27,22 +28,389 @@ struct arena;
  *               you want; whether it be inside another arena, on the stack, in
  *               a memory map, or where ever your heart desires.
  *
- *               If you use this version of arena_init, DO NOT call
- *               arena_destroy. It will attempt to deallocate the underlying
- *               memory. You must do that manually, by whatever method it was
- *               originally allocated.
+ *               If you use this version of arena_init, arena_destroy won't
+ *               deallocate the underlying memory. You must do that manually,
+ *               by whatever method it was originally allocated, after calling
+ *               arena_destroy.
  *
  *               When using arena_init_, len must be at least
- *               max(size, 2*sizeof(size_t))*count + 7*sizeof(size_t) so
- *               that the arena header can be placed directly next to the raw
- *               memory, instead of being heap allocated.
+ *               arena_footprint(size, count) so that the arena header can be
+ *               placed directly next to the raw memory, instead of being heap
+ *               allocated.
+ *
+ * arena_footprint - The number of bytes an arena of `count' elements of size
+ *                   `size' occupies, header included. Elements are never
+ *                   smaller than 2*sizeof(size_t), since freed elements hold
+ *                   free list bookkeeping.
  */
 struct arena* arena_init(size_t size, size_t count);
 struct arena* arena_init_(size_t size, size_t count, void* mem, size_t len);
+size_t arena_footprint(size_t size, size_t count);
+
+/*
+ * Where an arena's memory comes from.
+ *
+ * alloc - Returns `len' bytes, aligned for any type, or NULL. Called once, by
+ *         arena_init_with, for the header and buffer together.
+ *
+ * free - Gives back what alloc returned, along with the same `len'. Called by
+ *        arena_destroy.
+ *
+ * Both get `ctx' as their first argument. The backing is copied into the
+ * arena, but `ctx' has to stay valid until the arena is destroyed. Scratch
+ * memory for arena_reorder, arena_trim and the like still comes from ALLOC.
+ */
+struct arena_backing {
+    void* (*alloc)(void* ctx, size_t len);
+    void  (*free)(void* ctx, void* p, size_t len);
+    void* ctx;
+};
+
+// ALLOC and FREE from arena_config.h, which arena_init uses.
+extern const struct arena_backing arena_heap_backing;
+
+/*
+ * arena_init_with - Like arena_init, with memory from `backing'.
+ *
+ * arena_init_aligned_with - Like arena_init_aligned, with memory from
+ *                           `backing'.
+ *
+ * arena_backing_of - A backing which takes memory from `parent', for arenas
+ *                    of arenas. Each child takes one element of `parent',
+ *                    so the elements have to be at least as big as the
+ *                    children's footprint, and aligned to at least 8 bytes
+ *                    (see arena_init_aligned); otherwise, arena_init_with
+ *                    fails.
+ */
+struct arena* arena_init_with(size_t size, size_t count, const struct arena_backing* backing);
+struct arena* arena_init_aligned_with(size_t size, size_t count, size_t align,
+                                      bool isolate, const struct arena_backing* backing);
+struct arena_backing arena_backing_of(struct arena* parent);
+
+/*
+ * arena_init_aligned - Like arena_init, but every element is aligned to
+ *                      `align' bytes, which must be a power of two. The
+ *                      element size is rounded up to a multiple of `align',
+ *                      so with `align' = 64, no element shares a cache line
+ *                      with another.
+ *
+ *                      If `isolate' is true, the arena header also gets its
+ *                      own cache line, so that threads touching the first few
+ *                      elements don't false-share with the allocator's
+ *                      bookkeeping.
+ *
+ * arena_init_aligned_ - The same, using pre-allocated memory. `len' must be
+ *                       at least arena_footprint_aligned(size, count, align,
+ *                       isolate), which allows for the worst-case padding.
+ */
+struct arena* arena_init_aligned(size_t size, size_t count, size_t align, bool isolate);
+struct arena* arena_init_aligned_(size_t size, size_t count, size_t align,
+                                  bool isolate, void* mem, size_t len);
+size_t arena_footprint_aligned(size_t size, size_t count, size_t align, bool isolate);
 
 void arena_reset(struct arena*);
 
+/*
+ * arena_alloc and arena_free are calls into arena.c. Define ARENA_INLINE
+ * before including this header to have their fast paths inlined instead; see
+ * arena_inline.h, which also exposes struct arena's layout.
+ */
 void* arena_alloc(struct arena*);
 void arena_free(struct arena*, void*);
 
+/*
+ * arena_alloc_n - Allocates up to `n' elements at once, storing them in
+ *                 `out'. Returns how many were allocated, which is less than
+ *                 `n' only if the arena ran out. O(n), but much cheaper per
+ *                 element than calling arena_alloc in a loop.
+ *
+ * arena_free_n - Frees the `n' elements in `p'. NULL entries are skipped.
+ */
+size_t arena_alloc_n(struct arena*, void** out, size_t n);
+void arena_free_n(struct arena*, void** p, size_t n);
+
+/*
+ * Variable-size allocations, from a region (see region.h) attached to the
+ * arena, for when objects of one size come with strings and arrays of any
+ * size. arena_reset resets the region along with the arena, and
+ * arena_destroy destroys it. arena_rollback_to leaves it alone, and neither
+ * arena_snapshot nor arena_restore include it.
+ *
+ * arena_attach_region - Attaches `r' to the arena, which owns it from then on.
+ *                       Whatever was attached before is destroyed, so
+ *                       NULL just gets rid of it.
+ *
+ * arena_alloc_bytes - region_alloc from the attached region. Returns NULL if
+ *                     there is none, or when it's out of room. O(1).
+ */
+struct region;
+
+void arena_attach_region(struct arena*, struct region* r);
+void* arena_alloc_bytes(struct arena*, size_t n, size_t align);
+
+/*
+ * Waiting for an element, for when a full arena should push back on whoever
+ * is allocating rather than fail.
+ *
+ * arena_alloc_async - Returns an element if one is free. Otherwise, parks `w'
+ *                     and returns NULL; once an element is freed, `w' is
+ *                     unparked and w->ready(w->ctx, element) called, from
+ *                     inside whichever call freed it. Waiters are served in
+ *                     the order they parked, and allocations never jump the
+ *                     queue. O(1).
+ *
+ * arena_cancel_async - Unparks `w' without giving it an element. Returns
+ *                      false if it wasn't parked (any more). O(n) in the
+ *                      number of waiters.
+ *
+ * `w' belongs to the caller, and has to stay valid while it's parked.
+ * arena_free, arena_free_n, arena_reset and arena_rollback_to all serve
+ * waiters; elements freed by arena_free_remote reach them once the owner
+ * drains its queue. `ready' may allocate from, free into, or park on the
+ * arena again. While nobody's waiting, the only cost to arena_free is one
+ * well-predicted branch.
+ *
+ * Like arena_alloc, none of this is thread safe: everything happens on the
+ * thread which owns the arena.
+ */
+struct arena_waiter {
+    void (*ready)(void* ctx, void* p); // Gets the element.
+    void* ctx;
+    struct arena_waiter* next;         // Only used while parked.
+};
+
+void* arena_alloc_async(struct arena*, struct arena_waiter* w);
+bool arena_cancel_async(struct arena*, struct arena_waiter* w);
+
+/*
+ * After a while of allocating and freeing, the free list hands out elements
+ * in an essentially random order, and elements allocated together no longer
+ * end up next to each other.
+ *
+ * arena_reorder - Relinks the free list in address order, so that subsequent
+ *                 allocations fill the lowest free addresses first. Free
+ *                 elements at the top of the used part of the buffer are put
+ *                 back into the bump region. O(count), and needs count/8
+ *                 bytes of scratch memory; does nothing if that can't be
+ *                 allocated.
+ *
+ * arena_set_reorder - Makes arena_free call arena_reorder every `every'
+ *                     frees. 0 turns that off again, which is the default.
+ *                     With `every' proportional to the arena's count, that
+ *                     keeps arena_free O(1) amortized.
+ *
+ * arena_locality - Measures how scattered the free list is: how often two
+ *                  consecutive elements on it are on different pages, versus
+ *                  how often they would be if it were in address order.
+ *                  O(count).
+ */
+struct arena_locality {
+    size_t free;      // The number of elements on the free list.
+    size_t jumps;     // Page changes when walking the free list as-is.
+    size_t min_jumps; // Page changes an address-ordered free list would have.
+};
+
+void arena_reorder(struct arena*);
+void arena_set_reorder(struct arena*, size_t every);
+struct arena_locality arena_locality(struct arena*);
+
+/*
+ * Scoped allocation.
+ *
+ * arena_mark - Captures the arena's state, for arena_rollback_to. O(1).
+ *
+ * arena_rollback_to - Frees every element allocated since `mark' was taken,
+ *                     leaving elements allocated before it alone, whether
+ *                     they were freed since or not. O(1), plus O(n) in the
+ *                     number of elements freed since the mark.
+ *
+ *                     Elements allocated from the bump region can always be
+ *                     rolled back, so while the arena is still filling up,
+ *                     so can everything. But an element taken off the free
+ *                     list loses its link, so if anything came from the free
+ *                     list since the mark (or arena_reset, arena_reorder or
+ *                     arena_trim was called), this does nothing and returns
+ *                     false. Use an arena of its own for the scopes, reset
+ *                     between requests, to make sure rollbacks succeed.
+ *
+ * Marks nest: rolling back to a mark invalidates the marks taken after it,
+ * but not the ones before. Rolling back to an invalidated mark is an error,
+ * though not always a detected one. The atomic variants aren't covered.
+ */
+struct arena_mark {
+    void*  bufstart;
+    void*  free_list;
+    size_t pops;
+};
+
+struct arena_mark arena_mark(struct arena*);
+bool arena_rollback_to(struct arena*, struct arena_mark mark);
+
+/*
+ * Handing memory back to the OS.
+ *
+ * Every element the arena has ever handed out stays resident, even once it's
+ * free again, since free elements hold the free list. These hand the pages
+ * of free elements back (see RELEASE in arena_config.h), so that a burst of
+ * allocations doesn't leave the process at peak RSS forever.
+ *
+ * arena_trim - Hands back every page which holds nothing but free elements.
+ *              Free elements at the top of the used part of the buffer are
+ *              put back into the bump region, like arena_reorder does. Whole
+ *              pages of free elements below that are taken off the free list
+ *              and only handed out again once both the free list and the bump
+ *              region are empty. O(count). Needs count/8 bytes of scratch
+ *              memory, plus count/8 bytes for as long as any elements are
+ *              handed back; only hands back the top of the buffer if that
+ *              can't be allocated. Returns how many bytes were handed back.
+ *
+ * arena_reset_retain - arena_reset, but also hands back the pages of the
+ *                      buffer past its first `retain' bytes. Returns how
+ *                      many bytes were handed back.
+ *
+ * Neither touches the pages it hands back, and the arena doesn't touch them
+ * again until it hands out elements on them. Calling arena_trim on an arena
+ * from arena_init_ allocates memory which only arena_reset and arena_destroy
+ * give back, so destroy such an arena before getting rid of its memory.
+ */
+size_t arena_trim(struct arena*);
+size_t arena_reset_retain(struct arena*, size_t retain);
+
+/*
+ * Visiting every live element.
+ *
+ * Nothing in the arena says which elements are live, so iteration first
+ * builds a live map: one bit per element of the used part of the buffer,
+ * built by walking the free list in O(count). The arena must not be modified
+ * while a map of it is being used.
+ *
+ * arena_foreach_live - Calls `fn' on every live element, in address order,
+ *                      prefetching a few elements ahead. Returns false if
+ *                      the map couldn't be allocated.
+ *
+ * arena_live_map - Builds a live map, or returns NULL if it couldn't be
+ *                  allocated. Free it with arena_live_destroy.
+ *
+ * arena_live_slots - The number of elements covered by a live map.
+ *
+ * arena_live_visit - Like arena_foreach_live, but only visits elements with
+ *                    an index in [begin, end). Any number of threads may
+ *                    visit disjoint ranges of the same map at once, which
+ *                    makes for easy chunked, parallel sweeps.
+ */
+typedef void (*arena_visitor)(void* obj, void* ctx);
+struct arena_live;
+
+bool arena_foreach_live(struct arena*, arena_visitor fn, void* ctx);
+struct arena_live* arena_live_map(struct arena*);
+size_t arena_live_slots(const struct arena_live*);
+void arena_live_visit(const struct arena_live*, size_t begin, size_t end,
+                      arena_visitor fn, void* ctx);
+void arena_live_destroy(struct arena_live*);
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is the used part of the buffer plus the free list, written to a
+ * file descriptor with writev. The free list is written as element indices,
+ * not pointers, so a snapshot doesn't care where the buffer is: it restores
+ * into any arena with the same size and count, even in another process of
+ * the same build (nothing is byte-swapped). Live elements come back at the
+ * same offsets into the buffer, and the free list in the same order;
+ * elements arena_trim handed back come back on the free list, after the rest.
+ *
+ * arena_snapshot - Writes a snapshot of the whole arena to `fd'. O(count).
+ *                  Returns false if writing failed.
+ *
+ * arena_track_dirty - Clears the soft-dirty bit of every page in the process
+ *                     (Linux only), so that arena_snapshot_dirty can tell
+ *                     which pages were written to since. Returns false if
+ *                     the kernel doesn't keep soft-dirty bits.
+ *
+ * arena_snapshot_dirty - arena_snapshot, but only writes the pages written to
+ *                        since the last arena_track_dirty or
+ *                        arena_snapshot_dirty, then clears the bits again.
+ *                        O(free + pages). Returns false if writing failed or
+ *                        the bits couldn't be read.
+ *
+ * arena_restore - Reads a snapshot of either kind into `a', which must have
+ *                 the same size and count as the arena it was taken of. A
+ *                 dirty snapshot only holds what changed, so it has to go on
+ *                 top of the one taken before it. Returns false if the
+ *                 snapshot doesn't fit `a' or is malformed, leaving `a'
+ *                 alone, or if reading failed partway, leaving `a' with
+ *                 nothing allocated, as after arena_reset. An attached
+ *                 region is left alone either way.
+ *
+ * For incremental snapshots, call arena_track_dirty, take a base with
+ * arena_snapshot, then use arena_snapshot_dirty from then on; to restore,
+ * restore them all in the same order. Soft-dirty bits are per process, so
+ * only one arena can be tracked at a time, and nothing else in the process
+ * may clear them.
+ *
+ * The arena must not change, from any thread, while a snapshot is being
+ * taken; remote frees are drained first. Snapshots don't work with the atomic
+ * variants, and profile samples aren't restored.
+ */
+bool arena_snapshot(struct arena*, int fd);
+bool arena_track_dirty(void);
+bool arena_snapshot_dirty(struct arena*, int fd);
+bool arena_restore(struct arena*, int fd);
+
+/*
+ * arena_alloc_atomic, arena_free_atomic - Lock-free versions of arena_alloc
+ *                                         and arena_free, safe to call from
+ *                                         any number of threads at once.
+ *
+ * An arena must be used either exclusively through the atomic variants or
+ * exclusively through the plain ones between resets. Mixing the two loses
+ * track of freed elements. arena_reset and arena_destroy are never thread
+ * safe, and the atomic variants don't check for double-frees when HEAP_CHECK
+ * is defined.
+ *
+ * The atomic variants require the arena's buffer to be smaller than 1 TiB.
+ */
+void* arena_alloc_atomic(struct arena*);
+void arena_free_atomic(struct arena*, void*);
+
+/*
+ * arena_free_remote - Frees an element of an arena owned by another thread,
+ *                     from any thread. Lock-free, and O(1).
+ *
+ * The element goes onto a queue of the arena's own, never onto its free list,
+ * so these frees don't contend with the owner's. The owner takes the whole
+ * queue over in one go once its free list runs dry, in arena_alloc and
+ * arena_alloc_n (and before arena_trim, arena_reorder, arena_rollback_to,
+ * arena_locality and arena_live_map look at the free list). Double-free
+ * checks and the `frees' counter happen then, too.
+ *
+ * Until it's drained, a remotely freed element still counts as live.
+ * arena_reset drops the queue, and must not race with remote frees.
+ */
+void arena_free_remote(struct arena*, void*);
+
+/*
+ * arena_stats - Takes a snapshot of the arena's counters. They are only kept
+ *               when arena.c is built with ARENA_STATS (see arena_config.h);
+ *               otherwise, the snapshot is all zeros. O(1).
+ *
+ * When the arena is being used through the atomic variants, the snapshot may
+ * be slightly out of date, and `peak' isn't maintained.
+ */
+struct arena_stats {
+    size_t live;     // Elements currently allocated.
+    size_t peak;     // The most elements ever allocated at once.
+    size_t allocs;   // Successful allocations, ever.
+    size_t frees;    // Frees of non-NULL pointers, ever.
+    size_t failed;   // Allocations which returned NULL, ever.
+    size_t bumped;   // Allocations served fresh from the unused buffer.
+    size_t recycled; // Allocations served from the free list.
+};
+
+void arena_stats(struct arena*, struct arena_stats*);
+
 void arena_destroy(struct arena*);
+
+#ifdef ARENA_INLINE
+    #include "arena_inline.h"
+#endif
@@ -0,0 +1,301 @@
+#pragma once
+
+/*
+ * A compile-time specialized, header-only arena for C++.
+ *
+ * This is the same algorithm as arena.c (an intrusive free list, and a bump
+ * region handed out whenever the free list is empty), but with the element
+ * type and count known at compile time. The stride and alignment are
+ * constants, the buffer lives inside the arena object itself, and alloc/free
+ * are small enough to inline into their callers.
+ *
+ * Unlike arena.c, there are no guard bits. Out-of-range frees are caught by
+ * assert in debug builds.
+ *
+ * Requires C++17. With C++20 coroutines, alloc_async also lets a coroutine
+ * wait for an element of a full arena.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#if __has_include(<memory_resource>)
+    #include <memory_resource>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    #include <coroutine>
+    #define ARENA_COROUTINES
+#endif
+
+namespace arena_alloc {
+
+template <typename T, std::size_t Count>
+class arena {
+    // A free slot holds the free list link; a live one holds a T.
+    union slot {
+        slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+public:
+    static constexpr std::size_t stride    = sizeof(slot);
+    static constexpr std::size_t alignment = alignof(slot);
+    static constexpr std::size_t count     = Count;
+
+    arena() noexcept = default;
+
+    // Elements point into the arena, so it can't move.
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    /*
+     * alloc - Returns uninitialized, suitably aligned storage for one T, or
+     *         nullptr if the arena is full.
+     *
+     * free - Returns storage from alloc to the arena. nullptr is ignored.
+     */
+    void* alloc() noexcept
+    {
+        slot* s = free_;
+
+        if(s != nullptr)
+        {
+            free_ = s->next;
+            return s;
+        }
+
+        // Oh no we're out of elements!
+        if(bump_ == Count) return nullptr;
+
+        return &slots_[bump_++];
+    }
+
+    void free(void* p) noexcept
+    {
+        if(p == nullptr) return;
+
+        assert(owns(p) && "Trying to free a pointer which was not allocated in this arena.");
+
+#ifdef ARENA_COROUTINES
+        if(waiters_ != nullptr)
+        {
+            serve(p);
+            return;
+        }
+#endif
+
+        slot* s = static_cast<slot*>(p);
+        s->next = free_;
+        free_   = s;
+    }
+
+#ifdef ARENA_COROUTINES
+    class alloc_awaiter;
+
+    /*
+     * alloc_async - `co_await a.alloc_async()' is alloc, except that while
+     *               the arena is full, the coroutine is suspended until an
+     *               element is freed, and resumed with it from inside that
+     *               free (or reset). Coroutines are resumed in the order they
+     *               were suspended, and never jump the queue. Destroying a
+     *               suspended coroutine takes it out of the queue.
+     *
+     * The resumed coroutine runs on the stack of that free or reset, before
+     * it returns, so whoever calls free must be ready for waiters to run
+     * arbitrary code there. Resumed coroutines may use the arena again
+     * freely, but a free made from one which serves the next waiter resumes
+     * it one level deeper: a chain of N such frees nests N resumptions. To
+     * keep the stack flat, have resumed coroutines hand off to a scheduler
+     * instead of freeing straight away.
+     */
+    alloc_awaiter alloc_async() noexcept { return alloc_awaiter(*this); }
+
+    class alloc_awaiter {
+    public:
+        explicit alloc_awaiter(arena& a) noexcept : arena_(a) {}
+
+        alloc_awaiter(const alloc_awaiter&) = delete;
+        alloc_awaiter& operator=(const alloc_awaiter&) = delete;
+
+        ~alloc_awaiter()
+        {
+            if(parked_) arena_.unpark(this);
+        }
+
+        bool await_ready() noexcept
+        {
+            if(arena_.waiters_ == nullptr)
+                p_ = arena_.alloc();
+
+            return p_ != nullptr;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            handle_ = h;
+            arena_.park(this);
+        }
+
+        void* await_resume() const noexcept { return p_; }
+
+    private:
+        friend class arena;
+
+        arena&                  arena_;
+        void*                   p_      = nullptr;
+        std::coroutine_handle<> handle_;
+        alloc_awaiter*          next_   = nullptr;
+        bool                    parked_ = false;
+    };
+#endif
+
+    /*
+     * construct - Allocates a T and constructs it in place from `args', so
+     *             nothing gets copied or moved. Returns nullptr if the arena
+     *             is full. If T's constructor throws, the storage is freed
+     *             again before the exception propagates.
+     *
+     * destroy - Destroys a T made by construct and frees its storage.
+     */
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        void* p = alloc();
+        if(p == nullptr) return nullptr;
+
+        try {
+            return ::new(p) T(std::forward<Args>(args)...);
+        } catch(...) {
+            free(p);
+            throw;
+        }
+    }
+
+    void destroy(T* p) noexcept
+    {
+        if(p == nullptr) return;
+
+        p->~T();
+        free(p);
+    }
+
+    // Frees every element at once, in O(1). Destructors are not run.
+    void reset() noexcept
+    {
+        bump_ = 0;
+        free_ = nullptr;
+
+#ifdef ARENA_COROUTINES
+        while(waiters_ != nullptr && bump_ != Count)
+            serve(&slots_[bump_++]);
+#endif
+    }
+
+    // Returns true if `p' points into the arena's buffer.
+    bool owns(const void* p) const noexcept
+    {
+        auto* c = static_cast<const unsigned char*>(p);
+        auto* b = reinterpret_cast<const unsigned char*>(slots_);
+
+        return b <= c && c < b + sizeof(slots_);
+    }
+
+private:
+#ifdef ARENA_COROUTINES
+    void park(alloc_awaiter* w) noexcept
+    {
+        w->parked_ = true;
+
+        if(last_waiter_ != nullptr)
+            last_waiter_->next_ = w;
+        else
+            waiters_ = w;
+
+        last_waiter_ = w;
+    }
+
+    void unpark(alloc_awaiter* w) noexcept
+    {
+        alloc_awaiter* prev = nullptr;
+
+        for(alloc_awaiter** c = &waiters_; *c != nullptr; prev = *c, c = &(*c)->next_)
+            if(*c == w)
+            {
+                *c = w->next_;
+                if(last_waiter_ == w) last_waiter_ = prev;
+                break;
+            }
+
+        w->parked_ = false;
+    }
+
+    // Resumes the oldest waiter with `p'.
+    void serve(void* p) noexcept
+    {
+        alloc_awaiter* w = waiters_;
+
+        if((waiters_ = w->next_) == nullptr)
+            last_waiter_ = nullptr;
+
+        w->parked_ = false;
+        w->p_      = p;
+        w->handle_.resume();
+    }
+
+    alloc_awaiter* waiters_     = nullptr; // Suspended in alloc_async, oldest
+    alloc_awaiter* last_waiter_ = nullptr; // first.
+#endif
+
+    std::size_t bump_ = 0;       // The number of slots ever bumped.
+    slot*       free_ = nullptr; // The first free slot.
+    slot        slots_[Count];
+};
+
+#if __has_include(<memory_resource>)
+
+/*
+ * A std::pmr::memory_resource which serves allocations that fit in one of an
+ * arena's slots from the arena, and passes anything bigger (or anything
+ * arriving once the arena is full) on to `upstream'. Use it with the
+ * std::pmr containers, e.g. std::pmr::list<T>, whose nodes are fixed size.
+ */
+template <typename Arena>
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(Arena& a,
+                            std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) noexcept
+        : arena_(a), upstream_(upstream) {}
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        if(bytes <= Arena::stride && align <= Arena::alignment)
+            if(void* p = arena_.alloc())
+                return p;
+
+        return upstream_->allocate(bytes, align);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t align) override
+    {
+        if(arena_.owns(p))
+            arena_.free(p);
+        else
+            upstream_->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    Arena& arena_;
+    std::pmr::memory_resource* upstream_;
+};
+
+#endif
+
+} // namespace arena_alloc
@@ -0,0 +1,122 @@
+#pragma once
+
+/*
+ * Build-time customization shared by every allocator in this directory. Edit
+ * this file instead of the individual .c files.
+ */
+
+/*** BEGIN CUSTOMIZATION ***/
+
+// Default implementation - just use standard malloc + free. Feel free to
+// redefine ALLOC and FREE to fit your needs. Obviously, their prototypes must
+// be identical to those of malloc and free.
+#include <stdlib.h>
+#define ALLOC malloc
+#define FREE  free
+
+// By default, turn on heap checking only in DEBUG builds.
+// If HEAP_CHECK is defined, arena_free and arena_reset become O(n), but you get
+// double-free protection.
+#ifdef DEBUG
+    #define HEAP_CHECK
+#endif
+
+// Define ARENA_HARDEN for cheap, always-on protection in production builds:
+// free list pointers are masked with a per-arena secret, double-frees are
+// detected in O(1), and every POISON_EVERY'th freed element is filled with
+// POISON_BYTE and checked for stray writes when it's reallocated. Only the
+// single-threaded operations are hardened, not the atomic variants.
+// #define ARENA_HARDEN
+#define POISON_EVERY 64
+#define POISON_BYTE  0xDB
+
+// Define ARENA_STATS to have every arena keep counters for arena_stats. They
+// cost an increment or two per operation.
+// #define ARENA_STATS
+
+// Define ARENA_PREFETCH to have every allocation from the free list prefetch
+// the next free element, whose link the following allocation will read. Once
+// the free list is long and scattered, that read misses the cache; this hides
+// the miss behind whatever the caller does between allocations. It costs an
+// instruction per allocation otherwise. Defining it on the command line also
+// covers the inline fast paths (see arena_inline.h).
+// #define ARENA_PREFETCH
+
+// Built with -fsanitize=address, arena.c poisons every element which isn't
+// allocated, so ASan catches any access to one exactly as it would for
+// malloc. Define ARENA_VALGRIND (with valgrind/memcheck.h installed) to have
+// each arena describe itself to Valgrind as a mempool instead. Either way,
+// the inline fast paths are turned off, and memory passed to arena_init_ must
+// go through arena_destroy before it's reused.
+// #define ARENA_VALGRIND
+
+// Define ARENA_PROFILE to build the sampling profiler of arena_profile.h into
+// arena.c. Arenas then sample one allocation about every PROFILE_RATE bytes,
+// recording up to PROFILE_DEPTH frames of its stack. Needs backtrace (glibc,
+// or libexecinfo) and libm.
+// #define ARENA_PROFILE
+#define PROFILE_RATE  (512*1024)
+#define PROFILE_DEPTH 32
+
+// The size of a cache line on the target, used when arenas are asked to keep
+// their header and elements from sharing one.
+#define CACHE_LINE 64
+
+// The size of an ordinary page on the target.
+#define PAGE 4096
+
+// How arena_trim and bitmap_arena_trim hand pages back to the OS; must return
+// 0 on success. MADV_FREE is cheaper, but the kernel only takes the pages
+// back under memory pressure, so RSS doesn't drop right away. Without
+// madvise, nothing is ever handed back.
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/mman.h>
+#endif
+
+#ifdef MADV_DONTNEED
+    #define RELEASE(p, len) madvise((p), (len), MADV_DONTNEED)
+#else
+    #define RELEASE(p, len) (-1)
+#endif
+
+// The size of a huge page on the target, which mmap-backed arenas round their
+// mappings up to when asked for MAP_HUGETLB.
+#define HUGE_PAGE (2*1024*1024)
+
+#include <stdio.h>
+// Set this to your own custom handling. Once an error has been triggered,
+// heap state is undefined. I suggest changing this to a function which either
+// dumps core or breaks into a debugger. A backtrace is extremely useful when
+// double-frees are detected.
+//
+// It's marked cold so that the compiler moves the paths that call it out of
+// the way of the ones that don't.
+#ifdef __GNUC__
+    #define COLD __attribute__((cold))
+#else
+    #define COLD
+#endif
+
+COLD static inline void error(const char* message)
+{
+    fputs(message, stderr);
+    fflush(stdout);
+    exit(314);
+}
+
+/*** END CUSTOMIZATION ***/
+
+#include <stdint.h>
+
+// Hands the whole pages inside [begin, end) back to the OS with RELEASE, and
+// returns how many bytes that was.
+static inline size_t release_pages(void* begin, void* end)
+{
+    uintptr_t b = ((uintptr_t)begin + PAGE - 1) & ~(uintptr_t)(PAGE - 1);
+    uintptr_t e = (uintptr_t)end & ~(uintptr_t)(PAGE - 1);
+
+    if(b >= e || RELEASE((void*)b, e - b) != 0)
+        return 0;
+
+    return e - b;
+}
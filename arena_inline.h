@@ -0,0 +1,190 @@
+#pragma once
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The layout of struct arena, and inline versions of the arena_alloc and
+ * arena_free fast paths which use it.
+ *
+ * arena.h keeps struct arena opaque, so every allocation is a call into
+ * arena.c. Defining ARENA_INLINE before including arena.h (or including this
+ * header directly) exposes the layout instead, and with ARENA_INLINE,
+ * arena_alloc and arena_free calls are handled inline whenever they can be:
+ * bumping the next untouched element, popping an intact free list head, or
+ * pushing a pointer that's in range. Everything else - running out, a
+ * corrupted guard, a foreign pointer, NULL - falls back to the out-of-line
+ * functions, which behave exactly as they always have.
+ *
+ * Arenas whose operations need more than that (arena.c built with
+ * ARENA_STATS, ARENA_HARDEN, HEAP_CHECK, ASan or ARENA_VALGRIND, a
+ * reordering arena, or one with waiters parked by arena_alloc_async) set
+ * `checked', and the inline versions send them straight to arena.c. So the
+ * layout and the inline versions don't depend on how arena.c was built, and
+ * mixing translation units with and without ARENA_INLINE is fine.
+ *
+ * The layout is an implementation detail: code built against this header
+ * has to be rebuilt along with arena.c.
+ */
+
+#ifdef __GNUC__
+    #define ARENA_LIKELY(x)   __builtin_expect(!!(x), 1)
+    #define ARENA_UNLIKELY(x) __builtin_expect(!!(x), 0)
+    #define ARENA_PEEK(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+    #define ARENA_LIKELY(x)   (x)
+    #define ARENA_UNLIKELY(x) (x)
+    #define ARENA_PEEK(x)     (x)
+#endif
+
+// See ARENA_PREFETCH in arena_config.h. Only a hint, so it's fine for this to
+// differ between translation units.
+#if defined(ARENA_PREFETCH) && defined(__GNUC__)
+    #define ARENA_PREFETCH_NODE(p) __builtin_prefetch(p)
+#else
+    #define ARENA_PREFETCH_NODE(p) ((void)0)
+#endif
+
+// This is actually a shadow structure in that we allocate AT LEAST enough
+// space for a node. An unallocated node uses the structure to store a pointer
+// to the next free node. When the node is allocated, the whole structure
+// (including the space for the `next' pointer) is used for user data.
+struct arena_node {
+    uint64_t           guard; // Protects the node from corruption.
+    struct arena_node* next;  // Points to the next free object in the buffer.
+};
+
+// A fibonacci pattern of bits, to detect corruption. Hopefully unlikely to
+// appear in user code.
+// 1011000111110000000011111111111110000000000000000000001111111111
+// NOTE: The nibbles have been reversed so that on little endian machines the
+// most entropy is in the LSBs, where most manipulation takes place.
+#define ARENA_GUARD_BITS 0xFF30000811100F1B
+
+struct arena {
+    size_t size;    // The size of each node.
+    size_t count;   // The number of nodes in the buffer.
+    bool checked; // True if every operation has to go through arena.c.
+
+    struct arena_node* free_list; // Points to the first node in the free list.
+    struct arena_node* bufstart;  // Points to the first element of the buffer
+                                  // which has never been handed out.
+    struct arena_node* buffer;    // Points to the raw arena buffer.
+    struct arena_node* bufend;    // Points one past the last element in the
+                                  // buffer.
+
+    size_t pops; // Allocations which didn't come from the bump region, plus
+                 // one for every other change to the free list but a push.
+                 // See arena_mark.
+
+    uint64_t atomic_list; // The free list used by the atomic variants. See
+                          // the comment above arena_alloc_atomic.
+
+    size_t reorder_every; // Reorder the free list every this many frees.
+    size_t reorder_left;  // Frees left until the next reorder. 0 if never.
+
+    struct arena_waiter* waiters;      // Parked by arena_alloc_async, oldest
+    struct arena_waiter* last_waiter;  // first. NULL if nobody's waiting.
+
+    struct arena_node* touched; // The highest bufstart seen when bufstart
+                                // last moved down. Above it and bufstart, the
+                                // buffer hasn't been touched since.
+    uint64_t* released;   // Bit i is set iff element i was handed back to the
+                          // OS by arena_trim. NULL if none are.
+    size_t released_left; // The number of bits set in `released'.
+    size_t released_hint; // No word of `released' below this one is nonzero.
+
+    // Pushed onto by any thread, so it's kept away from the fields above,
+    // which the owner writes on every operation.
+    struct arena_node* remote_list; // Elements freed by arena_free_remote,
+                                    // not yet drained into the free list.
+
+    struct arena_backing backing; // Where the arena's memory came from. All
+                                  // NULL if it came from arena_init_.
+    size_t backed;                // How much was asked of `backing'.
+
+    struct region* region; // Reset and destroyed along with the arena. NULL
+                           // if none is attached.
+
+    // Only used when arena.c is built with ARENA_HARDEN.
+    uint64_t secret;    // Keys free node guards and next pointers.
+    size_t poison_left; // Frees left until the next one gets poisoned.
+
+    // Only used when arena.c is built with ARENA_PROFILE.
+    size_t    sample_left; // Bytes left to allocate until the next sample.
+    uint64_t* sampled;     // Bit i is set iff element i is sampled. NULL
+                           // until the first sample.
+
+    // Only kept when arena.c is built with ARENA_STATS.
+    struct {
+        size_t allocs;    // Successful allocations.
+        size_t frees;     // Non-NULL frees.
+        size_t failed;    // Allocations which returned NULL.
+        size_t bumped;    // Allocations served from the bump region.
+        size_t discarded; // Elements freed implicitly by arena_reset.
+        size_t peak;      // The most elements ever live at once.
+    } stats;
+};
+
+// Hands out the next untouched element of the buffer, or NULL once it has
+// all been handed out. Only used once the free list is empty.
+static inline void* arena_lazy_alloc_inline(struct arena* a)
+{
+    struct arena_node* n = a->bufstart;
+
+    if(ARENA_UNLIKELY(n == a->bufend))
+        return NULL;
+
+    a->bufstart = (struct arena_node*)((char*)n + a->size);
+    return n;
+}
+
+static inline void* arena_alloc_inline(struct arena* a)
+{
+    if(ARENA_LIKELY(!a->checked))
+    {
+        struct arena_node* n = a->free_list;
+
+        if(ARENA_LIKELY(n != NULL))
+        {
+            if(ARENA_LIKELY(n->guard == ARENA_GUARD_BITS))
+            {
+                a->free_list = n->next;
+                ARENA_PREFETCH_NODE(a->free_list);
+                ++a->pops;
+                return n;
+            }
+        }
+        else if(ARENA_LIKELY(ARENA_PEEK(a->remote_list) == NULL))
+        {
+            void* p = arena_lazy_alloc_inline(a);
+            if(ARENA_LIKELY(p != NULL)) return p;
+        }
+    }
+
+    // Out of elements, remote frees to drain, corrupted, or checked.
+    return arena_alloc(a);
+}
+
+static inline void arena_free_inline(struct arena* a, void* p)
+{
+    struct arena_node* n = p;
+
+    // NULL is never in range, so it takes this path too.
+    if(ARENA_UNLIKELY(a->checked || !(a->buffer <= n && n < a->bufend)))
+    {
+        arena_free(a, p);
+        return;
+    }
+
+    n->guard = ARENA_GUARD_BITS;
+    n->next  = a->free_list;
+    a->free_list = n;
+}
+
+// Defined after the functions above, so they still call the real thing.
+#ifdef ARENA_INLINE
+    #define arena_alloc(a)   arena_alloc_inline(a)
+    #define arena_free(a, p) arena_free_inline((a), (p))
+#endif
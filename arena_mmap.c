@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include "arena_mmap.h"
+#include "arena_config.h"
+#include "arena_inline.h" // For the arena's copy of its backing.
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// From <numaif.h>, which is only around when libnuma's headers are. We go
+// through the raw system call, so libnuma itself isn't needed.
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+
+// The most NUMA nodes we know how to deal with.
+#define MAX_NODES 64
+
+/*
+ * Every mapping starts with a line holding its length, so that mmap_free can
+ * find it again. The arena header follows.
+ */
+struct mapping {
+    size_t len;
+};
+
+#define PREFIX CACHE_LINE
+
+// Returns the mask of online NUMA nodes, or just node 0 if it can't be read.
+static uint64_t online_nodes(void)
+{
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if(f == NULL) return 1;
+
+    // The file holds a list of ranges, like "0-3,6,8-9".
+    uint64_t mask = 0;
+    unsigned lo, hi;
+    int n;
+
+    while((n = fscanf(f, "%u-%u", &lo, &hi)) >= 1)
+    {
+        if(n == 1) hi = lo;
+
+        for(unsigned i = lo; i <= hi && i < MAX_NODES; ++i)
+            mask |= UINT64_C(1) << i;
+
+        if(fgetc(f) != ',') break;
+    }
+
+    fclose(f);
+    return mask == 0 ? 1 : mask;
+}
+
+static bool bind(void* mem, size_t len, int node)
+{
+    unsigned long mask;
+    int mode;
+
+    if(node == ARENA_NUMA_ANY)
+        return true;
+
+    if(node == ARENA_NUMA_INTERLEAVE)
+    {
+        mask = (unsigned long)online_nodes();
+        mode = MPOL_INTERLEAVE;
+    }
+    else if(node >= 0 && node < MAX_NODES)
+    {
+        mask = 1UL << node;
+        mode = MPOL_BIND;
+    }
+    else
+        return false;
+
+    // The kernel only looks at the first maxnode - 1 bits, so one more than
+    // the mask holds, like libnuma does.
+    return syscall(SYS_mbind, mem, len, mode, &mask,
+                   (unsigned long)(sizeof(mask)*8 + 1), 0) == 0;
+}
+
+static inline size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+// Maps `len' bytes according to the options in `ctx', plus the prefix.
+static void* mmap_alloc(void* ctx, size_t len)
+{
+    const struct arena_mmap_opts* o = ctx;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void*  mem  = MAP_FAILED;
+
+    len += PREFIX;
+
+    if(o->hugetlb)
+    {
+        mem = mmap(NULL, round_up(len, HUGE_PAGE), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mem != MAP_FAILED)
+            len = round_up(len, HUGE_PAGE);
+    }
+
+    if(mem == MAP_FAILED)
+    {
+        len = round_up(len, page);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED) return NULL;
+
+        // Only a hint. Don't fail if THP is disabled.
+        if(o->thp)
+            madvise(mem, len, MADV_HUGEPAGE);
+    }
+
+    // Bind before anything touches the mapping, so that no page gets faulted
+    // in on the wrong node.
+    if(!bind(mem, len, o->node))
+    {
+        munmap(mem, len);
+        return NULL;
+    }
+
+    ((struct mapping*)mem)->len = len;
+    return (char*)mem + PREFIX;
+}
+
+// `ctx' is never used, and mustn't be: arena_mmap_backing's options only live
+// as long as arena_init_with, and arena_init_mmap clears it.
+static void mmap_free(void* ctx, void* p, size_t len)
+{
+    struct mapping* m = (struct mapping*)((char*)p - PREFIX);
+
+    (void)ctx;
+    (void)len;
+    munmap(m, m->len);
+}
+
+struct arena_backing arena_mmap_backing(const struct arena_mmap_opts* opts)
+{
+    return (struct arena_backing) { mmap_alloc, mmap_free, (void*)opts };
+}
+
+struct arena* arena_init_mmap(size_t size, size_t count, const struct arena_mmap_opts* opts)
+{
+    struct arena_mmap_opts o = opts != NULL ? *opts
+        : (struct arena_mmap_opts) { .thp = true, .node = ARENA_NUMA_ANY };
+    struct arena_backing b = arena_mmap_backing(&o);
+
+    struct arena* a = arena_init_aligned_with(size, count, o.align == 0 ? 1 : o.align,
+                                              false, &b);
+
+    // `o' is only needed until the mapping is made, so don't leave the arena
+    // pointing at it.
+    if(a != NULL)
+        a->backing.ctx = NULL;
+
+    return a;
+}
+
+void arena_destroy_mmap(struct arena* a)
+{
+    arena_destroy(a);
+}
+
+struct node_arena {
+    struct arena* arena;
+    char* lo; // The arena's mapping, for arena_numa_free.
+    char* hi;
+};
+
+struct arena_numa_set {
+    size_t nnodes;                         // The number of online nodes.
+    struct node_arena* by_node[MAX_NODES]; // Indexed by node id.
+    struct node_arena nodes[];             // Dense, one per online node.
+};
+
+struct arena_numa_set* arena_numa_set_init(size_t size, size_t count, const struct arena_mmap_opts* opts)
+{
+    struct arena_mmap_opts o = opts != NULL ? *opts
+        : (struct arena_mmap_opts) { .thp = true };
+    uint64_t online = online_nodes();
+    size_t n = (size_t)__builtin_popcountll(online);
+
+    struct arena_numa_set* s = ALLOC(sizeof(struct arena_numa_set)
+                                   + n*sizeof(struct node_arena));
+    if(s == NULL) return NULL;
+
+    s->nnodes = 0;
+
+    for(int i = 0; i < MAX_NODES; ++i)
+    {
+        s->by_node[i] = NULL;
+
+        if(!(online & UINT64_C(1) << i))
+            continue;
+
+        o.node = i;
+
+        struct arena* a = arena_init_mmap(size, count, &o);
+        if(a == NULL)
+        {
+            arena_numa_set_destroy(s);
+            return NULL;
+        }
+
+        struct mapping* m = (struct mapping*)((char*)a - PREFIX);
+
+        s->nodes[s->nnodes] = (struct node_arena) {
+            .arena = a,
+            .lo    = (char*)m,
+            .hi    = (char*)m + m->len
+        };
+        s->by_node[i] = &s->nodes[s->nnodes++];
+    }
+
+    return s;
+}
+
+struct arena* arena_numa_local(struct arena_numa_set* s)
+{
+    unsigned cpu, node;
+
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0
+    || node >= MAX_NODES || s->by_node[node] == NULL)
+        return s->nodes[0].arena;
+
+    return s->by_node[node]->arena;
+}
+
+void* arena_numa_alloc(struct arena_numa_set* s)
+{
+    struct arena* local = arena_numa_local(s);
+    void* p = arena_alloc_atomic(local);
+
+    for(size_t i = 0; p == NULL && i < s->nnodes; ++i)
+        if(s->nodes[i].arena != local)
+            p = arena_alloc_atomic(s->nodes[i].arena);
+
+    return p;
+}
+
+void arena_numa_free(struct arena_numa_set* s, void* p)
+{
+    if(p == NULL) return;
+
+    for(size_t i = 0; i < s->nnodes; ++i)
+        if(s->nodes[i].lo <= (char*)p && (char*)p < s->nodes[i].hi)
+        {
+            arena_free_atomic(s->nodes[i].arena, p);
+            return;
+        }
+
+    error("Trying to free a pointer which was not allocated in this arena.");
+}
+
+void arena_numa_set_destroy(struct arena_numa_set* s)
+{
+    for(size_t i = 0; i < s->nnodes; ++i)
+        arena_destroy_mmap(s->nodes[i].arena);
+
+    FREE(s);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "arena.h"
+
+/*
+ * Arenas backed by their own memory mapping instead of the heap, so that big
+ * arenas can sit on huge pages and on a chosen NUMA node.
+ *
+ * Linux only.
+ */
+
+// Special values for arena_mmap_opts.node.
+#define ARENA_NUMA_ANY        (-1) // Leave placement to the kernel.
+#define ARENA_NUMA_INTERLEAVE (-2) // Spread pages over every online node.
+
+struct arena_mmap_opts {
+    size_t align;  // Passed on to arena_init_aligned_. 0 means 1.
+    bool hugetlb;  // Try MAP_HUGETLB first. If no huge pages are reserved,
+                   // falls back to an ordinary mapping.
+    bool thp;      // madvise(MADV_HUGEPAGE) the mapping, so transparent huge
+                   // pages back it when MAP_HUGETLB isn't used or failed.
+    int node;      // The NUMA node to bind the mapping to, or one of the
+                   // ARENA_NUMA_* values above.
+};
+
+/*
+ * arena_init_mmap - Like arena_init, with memory placed according to `opts'.
+ *                   Passing NULL for `opts' is the same as a mapping with
+ *                   transparent huge pages and no NUMA policy.
+ *
+ * arena_destroy_mmap - The same as arena_destroy, which unmaps arenas created
+ *                      by arena_init_mmap.
+ *
+ * arena_mmap_backing - A backing for arena_init_with which maps memory
+ *                      according to `opts', for mixing mmap-backed arenas
+ *                      with others. `opts->align' is ignored; pass it to
+ *                      arena_init_aligned_with instead. `opts' only has to
+ *                      stay valid while arenas are being initialized with
+ *                      the backing.
+ */
+struct arena* arena_init_mmap(size_t size, size_t count, const struct arena_mmap_opts* opts);
+void arena_destroy_mmap(struct arena*);
+struct arena_backing arena_mmap_backing(const struct arena_mmap_opts* opts);
+
+/*
+ * A NUMA arena set holds one mmap-backed arena per online node, each bound to
+ * its node, so that threads can allocate memory which is local to them.
+ *
+ * Arenas in a set are shared between all threads running on their node, so
+ * the set always uses the atomic variants of arena_alloc and arena_free.
+ */
+struct arena_numa_set;
+
+/*
+ * arena_numa_set_init - Creates a set with `count' elements per node. The
+ *                       `node' field of `opts' is ignored.
+ *
+ * arena_numa_alloc - Allocates from the calling thread's node, or from the
+ *                    other nodes if its own arena is exhausted.
+ *
+ * arena_numa_free - Frees `p' into the arena it came from, whichever node
+ *                   the calling thread is on. O(nodes).
+ *
+ * arena_numa_local - Returns the arena of the calling thread's node.
+ */
+struct arena_numa_set* arena_numa_set_init(size_t size, size_t count, const struct arena_mmap_opts* opts);
+void* arena_numa_alloc(struct arena_numa_set*);
+void arena_numa_free(struct arena_numa_set*, void* p);
+struct arena* arena_numa_local(struct arena_numa_set*);
+void arena_numa_set_destroy(struct arena_numa_set*);
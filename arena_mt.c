@@ -0,0 +1,232 @@
+#include "arena_mt.h"
+#include "arena.h"
+#include "arena_inline.h" // For the depot's bounds.
+
+#include "arena_config.h"
+#include "sanitize.h"
+
+#include <pthread.h>
+#include <string.h>
+
+struct arena_mt {
+    pthread_mutex_t lock;  // Guards everything below.
+    struct arena*   arena; // The depot all magazines refill from.
+
+    struct magazine* magazines; // Every live magazine.
+    size_t allocs, frees, failed; // Counters of destroyed magazines.
+};
+
+#ifdef ARENA_STATS
+    // Counters are only ever written by their magazine's thread, but may be
+    // read by any thread calling arena_mt_stats.
+    #define BUMP(m, c) __atomic_store_n(&(m)->c, (m)->c + 1, __ATOMIC_RELAXED)
+    #define LOAD(m, c) __atomic_load_n(&(m)->c, __ATOMIC_RELAXED)
+#else
+    #define BUMP(m, c) ((void)0)
+#endif
+
+struct arena_mt* arena_mt_init(size_t size, size_t count)
+{
+    struct arena_mt* d = ALLOC(sizeof(struct arena_mt));
+    if(d == NULL) return NULL;
+
+    if((d->arena = arena_init(size, count)) == NULL)
+        goto fail;
+
+    d->magazines = NULL;
+    d->allocs = d->frees = d->failed = 0;
+
+    if(pthread_mutex_init(&d->lock, NULL) != 0)
+    {
+        arena_destroy(d->arena);
+        goto fail;
+    }
+
+    return d;
+
+fail:
+    FREE(d);
+    return NULL;
+}
+
+void arena_mt_destroy(struct arena_mt* d)
+{
+    pthread_mutex_destroy(&d->lock);
+    arena_destroy(d->arena);
+    FREE(d);
+}
+
+void magazine_init(struct magazine* m, struct arena_mt* d)
+{
+    m->depot  = d;
+    m->count  = 0;
+    m->allocs = m->frees = m->failed = 0;
+    m->prev   = NULL;
+
+    pthread_mutex_lock(&d->lock);
+
+    if((m->next = d->magazines) != NULL)
+        m->next->prev = m;
+    d->magazines = m;
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Slots in a magazine are free as far as the user can tell, so they're
+ * hidden from ASan and Valgrind just as the depot's free elements are, from
+ * when they go in until they're handed out or flushed.
+ */
+#ifdef SANITIZED
+    static void hide_slots(struct magazine* m, size_t begin, size_t end)
+    {
+        for(size_t i = begin; i < end; ++i)
+            HIDE(m->slots[i], m->depot->arena->size);
+    }
+
+    static void reveal_slots(struct magazine* m, size_t begin, size_t end)
+    {
+        for(size_t i = begin; i < end; ++i)
+            REVEAL(m->slots[i], m->depot->arena->size);
+    }
+#else
+    #define hide_slots(m, begin, end)   ((void)0)
+    #define reveal_slots(m, begin, end) ((void)0)
+#endif
+
+// Moves up to half a magazine's worth of slots from the depot into `m'.
+// Returns how many were moved. `m' must be empty.
+static size_t refill(struct magazine* m)
+{
+    struct arena_mt* d = m->depot;
+
+    pthread_mutex_lock(&d->lock);
+    m->count = arena_alloc_n(d->arena, m->slots, MAGAZINE_SIZE/2);
+    pthread_mutex_unlock(&d->lock);
+
+    hide_slots(m, 0, m->count);
+    return m->count;
+}
+
+// Returns the `n' least recently freed slots in `m' to the depot, keeping the
+// hot ones (which are more likely to still be in cache) in the magazine.
+static void flush(struct magazine* m, size_t n)
+{
+    struct arena_mt* d = m->depot;
+
+    // The depot takes them back as allocated elements.
+    reveal_slots(m, 0, n);
+
+    pthread_mutex_lock(&d->lock);
+    arena_free_n(d->arena, m->slots, n);
+    pthread_mutex_unlock(&d->lock);
+
+    m->count -= n;
+    memmove(m->slots, m->slots + n, m->count*sizeof(void*));
+}
+
+void magazine_destroy(struct magazine* m)
+{
+    struct arena_mt* d = m->depot;
+
+    flush(m, m->count);
+
+    pthread_mutex_lock(&d->lock);
+
+    d->allocs += m->allocs;
+    d->frees  += m->frees;
+    d->failed += m->failed;
+
+    if(m->prev != NULL) m->prev->next = m->next;
+    else                d->magazines  = m->next;
+    if(m->next != NULL) m->next->prev = m->prev;
+
+    pthread_mutex_unlock(&d->lock);
+}
+
+#if defined(HEAP_CHECK) || defined(ARENA_HARDEN)
+    // The checks arena_free makes, and then some, made as `p' goes into the
+    // magazine rather than when it's flushed: otherwise a bad free is only
+    // reported much later, and may have been handed out again by then. The
+    // depot's buffer never moves, so this doesn't need the lock.
+    //
+    // Only this magazine is searched, since the others belong to other
+    // threads. Under ASan, a slot which is in any magazine, or free in the
+    // depot, is hidden, so that catches the rest at once; otherwise a double
+    // free through two magazines is only caught once both are flushed.
+    static void check_free(struct magazine* m, void* p)
+    {
+        struct arena* a = m->depot->arena;
+        size_t off = (size_t)((char*)p - (char*)a->buffer);
+
+        if((char*)p < (char*)a->buffer || (char*)p >= (char*)a->bufend)
+            error("Trying to free a pointer which was not allocated in this arena.");
+
+        if(off % a->size != 0)
+            error("Trying to free a pointer into the middle of an object.");
+
+        if(IS_HIDDEN(p))
+            error("Double-free detected.");
+
+        for(size_t i = 0; i < m->count; ++i)
+            if(m->slots[i] == p)
+                error("Double-free detected.");
+    }
+#else
+    #define check_free(m, p) ((void)0)
+#endif
+
+void* magazine_alloc(struct magazine* m)
+{
+    if(m->count == 0 && refill(m) == 0)
+    {
+        BUMP(m, failed);
+        return NULL;
+    }
+
+    BUMP(m, allocs);
+
+    void* p = m->slots[--m->count];
+    REVEAL(p, m->depot->arena->size);
+
+    return p;
+}
+
+void magazine_free(struct magazine* m, void* p)
+{
+    if(p == NULL) return;
+
+    check_free(m, p);
+    BUMP(m, frees);
+
+    if(m->count == MAGAZINE_SIZE)
+        flush(m, MAGAZINE_SIZE/2);
+
+    HIDE(p, m->depot->arena->size);
+    m->slots[m->count++] = p;
+}
+
+void arena_mt_stats(struct arena_mt* d, struct arena_stats* s)
+{
+    pthread_mutex_lock(&d->lock);
+
+    arena_stats(d->arena, s);
+
+#ifdef ARENA_STATS
+    size_t allocs = d->allocs, frees = d->frees, failed = d->failed;
+
+    for(struct magazine* m = d->magazines; m != NULL; m = m->next)
+    {
+        allocs += LOAD(m, allocs);
+        frees  += LOAD(m, frees);
+        failed += LOAD(m, failed);
+    }
+
+    s->live   = allocs - frees;
+    s->allocs = allocs;
+    s->frees  = frees;
+    s->failed = failed;
+#endif
+
+    pthread_mutex_unlock(&d->lock);
+}
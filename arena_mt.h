@@ -0,0 +1,79 @@
+#pragma once
+#include "arena.h"
+
+/*
+ * A thread-safe front end for struct arena.
+ *
+ * The arena itself is shared between threads and guarded by a lock, but no
+ * thread is expected to touch it on the fast path. Instead, every thread owns
+ * a magazine: a small stack of free slots which it allocates from and frees
+ * into without synchronization. Only when a magazine runs dry (or overflows)
+ * does its thread take the lock, refilling (or flushing) half a magazine's
+ * worth of slots in one go.
+ *
+ * A slot may be freed into any magazine of the arena it came from, not just
+ * the one that handed it out.
+ */
+
+// The number of slots cached by each magazine. Bigger magazines take the lock
+// less often, but leave more of the arena stranded in idle threads.
+#ifndef MAGAZINE_SIZE
+    #define MAGAZINE_SIZE 64
+#endif
+
+struct arena_mt;
+
+// Magazines are meant to live in thread-local storage (or on the stack of a
+// long-running thread), so their layout is public. Don't touch the fields.
+struct magazine {
+    struct arena_mt* depot; // The shared arena this magazine caches.
+    size_t           count; // The number of slots currently cached.
+    void*            slots[MAGAZINE_SIZE];
+
+    // This magazine's share of the counters, when built with ARENA_STATS.
+    // Only the owning thread writes them, so they cost no synchronization.
+    size_t allocs, frees, failed;
+    struct magazine* prev; // Links all magazines of a shared arena, so that
+    struct magazine* next; // arena_mt_stats can add up their counters.
+};
+
+/*
+ * arena_mt_init - Creates a shared arena. The parameters are the same as
+ *                 those of arena_init.
+ *
+ * arena_mt_destroy - Destroys a shared arena. All of its magazines must have
+ *                    been destroyed first.
+ */
+struct arena_mt* arena_mt_init(size_t size, size_t count);
+void arena_mt_destroy(struct arena_mt*);
+
+/*
+ * magazine_init - Attaches an empty magazine to a shared arena. Each magazine
+ *                 may only ever be used by one thread at a time.
+ *
+ * magazine_destroy - Returns every slot cached in the magazine to the shared
+ *                    arena.
+ */
+void magazine_init(struct magazine*, struct arena_mt*);
+void magazine_destroy(struct magazine*);
+
+/*
+ * magazine_alloc - Like arena_alloc. Returns NULL once both the magazine and
+ *                  the shared arena are out of slots.
+ *
+ * magazine_free - Like arena_free. In checked builds, freeing a slot twice is
+ *                 caught at once if it's still in this magazine, or with
+ *                 ASan, anywhere. A double free through two magazines is
+ *                 otherwise only caught once both have been flushed.
+ */
+void* magazine_alloc(struct magazine*);
+void magazine_free(struct magazine*, void*);
+
+/*
+ * arena_mt_stats - Sums up the counters of every magazine, living or dead, of
+ *                  a shared arena. `bumped', `recycled' and `peak' describe
+ *                  the shared arena itself, and count slots cached in
+ *                  magazines as allocated. All zeros unless built with
+ *                  ARENA_STATS.
+ */
+void arena_mt_stats(struct arena_mt*, struct arena_stats*);
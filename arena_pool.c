@@ -0,0 +1,321 @@
+#define _GNU_SOURCE   // For sched_getcpu.
+#define ARENA_INLINE  // Shards are only touched by their own thread.
+#include "arena_pool.h"
+#include "arena_config.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * The pool is one allocation holding every shard, back to back, each `block'
+ * bytes long: first a struct arena_shard, then the shard's arena, placed
+ * with arena_init_. `block' is rounded up to a power of two, so the shard an
+ * element belongs to is just its offset into the pool shifted right. The
+ * padding at the end of each block is never touched, so it costs address
+ * space, but no memory.
+ *
+ * Elements freed through another shard go onto their own arena's remote
+ * queue (see arena_free_remote), which arena_alloc drains by itself once the
+ * free list runs dry. A shard whose arena is empty even so steals the remote
+ * queue of another shard, by swapping its head with NULL, just as draining
+ * does. Nothing ever pops a single element off a queue, so there's no ABA.
+ *
+ * Elements on another shard's free list or in its bump region are only ever
+ * touched by that shard's thread, so getting at them takes that thread's
+ * help, or its absence:
+ *
+ *   - A shard nobody has joined is borrowed, by swapping its `joined' from 0
+ *     to BORROWED, which keeps out arena_pool_join just as a thread would.
+ *     The thief allocates a batch straight from its arena, then lets go.
+ *
+ *   - A joined shard gets its `wanted' flag set instead. Its thread checks it
+ *     on every alloc and free, and when it's set, allocates a batch from its
+ *     own arena and pushes it onto its own remote queue, for the thief to
+ *     take there on its next try.
+ *
+ * Either way the elements were allocated from their own arena, and go back
+ * to it through its remote queue when freed, like any other stolen element.
+ */
+
+struct arena_shard {
+    // Only touched by the thread which joined the shard.
+    struct arena*      arena;
+    struct arena_node* stolen; // Elements of other shards, not yet handed out.
+    struct arena_pool* pool;
+    size_t             index;
+    size_t             victim; // The shard to try stealing from first.
+
+    // Written by other threads, so keep it off the line above.
+    char pad[CACHE_LINE - 3*sizeof(void*) - 2*sizeof(size_t)];
+
+    int joined; // Nonzero while a thread has joined the shard, or BORROWED.
+    int wanted; // Set by a shard with nothing left, for this one to give some up.
+};
+
+#define BORROWED    2  // `joined' while another shard's thread allocates from it.
+#define STEAL_BATCH 32 // The most elements taken in one go from a free list.
+
+struct arena_pool {
+    char*    base;   // Shard i starts at base + (i << shift).
+    unsigned shift;  // log2 of the bytes taken up by each shard.
+    size_t   shards; // The number of shards.
+};
+
+#define SHARD_SIZE ((sizeof(struct arena_shard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+static inline size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+// Returns true if n is in the interval [low, high)
+static inline bool in_range(const void* low, const void* n, const void* high)
+{
+    return low <= n && n < high;
+}
+
+static inline struct arena_shard* shard(struct arena_pool* p, size_t i)
+{
+    return (struct arena_shard*)(p->base + (i << p->shift));
+}
+
+// The shard `ptr' belongs to.
+static inline struct arena_shard* owner(struct arena_pool* p, void* ptr)
+{
+    if(ARENA_UNLIKELY(!in_range(p->base, ptr, p->base + (p->shards << p->shift))))
+        error("Trying to free a pointer which was not allocated in this pool.");
+
+    return shard(p, (size_t)((char*)ptr - p->base) >> p->shift);
+}
+
+struct arena_pool* arena_pool_init(size_t size, size_t count, size_t shards)
+{
+    if(shards == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shards = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    size_t   need  = SHARD_SIZE + arena_footprint_aligned(size, count, 1, true);
+    unsigned shift = 6; // Blocks are at least a cache line.
+
+    while(((size_t)1 << shift) < need)
+        ++shift;
+
+    size_t block = (size_t)1 << shift;
+
+    struct arena_pool* p = ALLOC(sizeof(struct arena_pool) + CACHE_LINE - 1 + shards*block);
+    if(p == NULL) return NULL;
+
+    p->base   = (char*)round_up((uintptr_t)(p + 1), CACHE_LINE);
+    p->shift  = shift;
+    p->shards = shards;
+
+    for(size_t i = 0; i < shards; ++i)
+    {
+        struct arena_shard* s = shard(p, i);
+
+        // The headers are isolated, so that they don't share a line with the
+        // first few elements, which anyone may free.
+        *s = (struct arena_shard) {
+            .arena  = arena_init_aligned_(size, count, 1, true,
+                                          (char*)s + SHARD_SIZE, block - SHARD_SIZE),
+            .pool   = p,
+            .index  = i,
+            .victim = (i + 1) % shards
+        };
+
+        if(s->arena == NULL)
+        {
+            FREE(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+void arena_pool_destroy(struct arena_pool* p)
+{
+    for(size_t i = 0; i < p->shards; ++i)
+        arena_destroy(shard(p, i)->arena);
+
+    FREE(p);
+}
+
+// Takes the whole remote queue of the shard's arena.
+static inline struct arena_node* take(struct arena_shard* s)
+{
+    struct arena* a = s->arena;
+
+    // Only a load while the queue is empty, to keep the line shared.
+    if(__atomic_load_n(&a->remote_list, __ATOMIC_RELAXED) == NULL)
+        return NULL;
+
+    return __atomic_exchange_n(&a->remote_list, NULL, __ATOMIC_ACQUIRE);
+}
+
+struct arena_shard* arena_pool_join(struct arena_pool* p)
+{
+    int    cpu   = sched_getcpu();
+    size_t first = cpu < 0 ? 0 : (size_t)cpu % p->shards;
+
+    for(size_t k = 0; k < p->shards; ++k)
+    {
+        struct arena_shard* s = shard(p, (first + k) % p->shards);
+
+        // A borrowed shard is only held for one batch, so wait it out.
+        for(int idle = 0;; idle = 0)
+        {
+            if(__atomic_compare_exchange_n(&s->joined, &idle, 1,
+                   false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return s;
+
+            if(idle != BORROWED) break;
+        }
+    }
+
+    return NULL;
+}
+
+void arena_pool_leave(struct arena_shard* s)
+{
+    for(struct arena_node *n = s->stolen, *next; n != NULL; n = next)
+    {
+        next = n->next;
+        arena_free_remote(owner(s->pool, n)->arena, n);
+    }
+
+    s->stolen = NULL;
+    __atomic_store_n(&s->joined, 0, __ATOMIC_RELEASE);
+}
+
+// Allocates up to STEAL_BATCH elements from the shard's arena, and links them
+// into a chain. Only for the thread the arena belongs to for the moment.
+static struct arena_node* batch(struct arena_shard* s)
+{
+    void*  got[STEAL_BATCH];
+    size_t n = arena_alloc_n(s->arena, got, STEAL_BATCH);
+
+    struct arena_node* chain = NULL;
+
+    while(n > 0)
+    {
+        struct arena_node* e = got[--n];
+        e->next = chain;
+        chain   = e;
+    }
+
+    return chain;
+}
+
+// Answers a steal request: moves a batch onto the shard's own remote queue,
+// where the thief (or the shard itself, if it runs dry first) will find it.
+COLD static void give(struct arena_shard* s)
+{
+    __atomic_store_n(&s->wanted, 0, __ATOMIC_RELAXED);
+
+    for(struct arena_node *n = batch(s), *next; n != NULL; n = next)
+    {
+        next = n->next;
+        arena_free_remote(s->arena, n);
+    }
+}
+
+// Takes a batch from the free list of a shard nobody has joined, or asks a
+// joined one to give up a batch of its own.
+static struct arena_node* borrow(struct arena_shard* v)
+{
+    int idle = 0;
+
+    if(!__atomic_compare_exchange_n(&v->joined, &idle, BORROWED,
+           false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        // Only a load while it's already asked, to keep the line shared.
+        if(idle == 1 && !__atomic_load_n(&v->wanted, __ATOMIC_RELAXED))
+            __atomic_store_n(&v->wanted, 1, __ATOMIC_RELAXED);
+
+        return NULL;
+    }
+
+    struct arena_node* n = batch(v);
+
+    __atomic_store_n(&v->joined, 0, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Takes the first nonempty remote queue of another shard, or failing that,
+// part of the first nonempty free list it can get at.
+static struct arena_node* steal(struct arena_shard* s)
+{
+    struct arena_pool* p = s->pool;
+
+    for(size_t pass = 0; pass < 2; ++pass)
+    {
+        for(size_t k = 0; k < p->shards; ++k)
+        {
+            size_t i = (s->victim + k) % p->shards;
+            if(i == s->index) continue;
+
+            struct arena_node* n = pass == 0 ? take(shard(p, i)) : borrow(shard(p, i));
+
+            if(n != NULL)
+            {
+                s->victim = i;
+                return n;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Called when the shard's own arena is empty, remote queue included.
+static void* refill(struct arena_shard* s)
+{
+    // Use up what's left of the last steal, before stealing again.
+    if(s->stolen == NULL && (s->stolen = steal(s)) == NULL)
+        return NULL;
+
+    struct arena_node* n = s->stolen;
+    s->stolen = n->next;
+
+    return n;
+}
+
+// Whether another shard has asked this one for elements.
+static inline bool wanted(struct arena_shard* s)
+{
+    return ARENA_UNLIKELY(__atomic_load_n(&s->wanted, __ATOMIC_RELAXED) != 0);
+}
+
+void* arena_pool_alloc(struct arena_shard* s)
+{
+    void* p = arena_alloc(s->arena);
+
+    if(wanted(s)) give(s);
+
+    return ARENA_LIKELY(p != NULL) ? p : refill(s);
+}
+
+void arena_pool_free(struct arena_shard* s, void* p)
+{
+    if(p == NULL) return;
+
+    struct arena_shard* o = owner(s->pool, p);
+
+    if(ARENA_LIKELY(o == s))
+    {
+        arena_free(s->arena, p);
+
+        if(wanted(s)) give(s);
+        return;
+    }
+
+    // Shard headers lie between the arenas' buffers, so this also checks
+    // it's really an element.
+    arena_free_remote(o->arena, p);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "arena.h"
+
+/*
+ * A pool of arenas, one per core, for when even magazines contend too much on
+ * their shared depot.
+ *
+ * Every shard of the pool is a plain struct arena, carved out of one big
+ * buffer, which only the thread that joined the shard allocates from or frees
+ * into. So the fast paths are those of arena_alloc and arena_free, with no
+ * synchronization at all.
+ *
+ * Freeing an element which belongs to another shard (found by its address)
+ * hands it to arena_free_remote, which queues it up for the owner to take
+ * over in one go once its own free list runs dry. A shard which still comes
+ * up empty steals the remote queues of other shards, and hands out their
+ * elements until the stolen chain runs out. Those elements still belong to
+ * their shard, and go back to it when freed.
+ *
+ * When no remote queue has anything either, it takes a batch straight from
+ * the arena of a shard nobody has joined, or else asks a joined one to
+ * give up a batch. That shard's thread answers on its next alloc or free,
+ * pushing the batch onto its own remote queue, so the asking shard's alloc
+ * returns NULL until then. A thread which holds on to a shard without calling
+ * into the pool never answers, so leave the pool while idle.
+ */
+struct arena_pool;
+struct arena_shard;
+
+/*
+ * arena_pool_init - Creates a pool of `shards' arenas, each holding `count'
+ *                   elements of `size' bytes. 0 shards means one per online
+ *                   CPU.
+ *
+ * arena_pool_destroy - Destroys the pool. Every shard must have been left.
+ */
+struct arena_pool* arena_pool_init(size_t size, size_t count, size_t shards);
+void arena_pool_destroy(struct arena_pool*);
+
+/*
+ * arena_pool_join - Gives the calling thread a shard of its own: the one of
+ *                   the CPU it's running on if that's free, any other free
+ *                   one otherwise. Returns NULL if every shard is taken.
+ *
+ * arena_pool_leave - Gives the shard back, for another thread to join. Its
+ *                    elements stay where they are, for other shards to steal
+ *                    meanwhile, and stolen elements are returned to their
+ *                    shards.
+ */
+struct arena_shard* arena_pool_join(struct arena_pool*);
+void arena_pool_leave(struct arena_shard*);
+
+/*
+ * arena_pool_alloc - Allocates from the shard. O(1), unless the shard's arena
+ *                    is empty: then O(n) in the elements taken over from its
+ *                    remote queue, or O(shards) to steal. Returns NULL if
+ *                    there was nothing to steal yet.
+ *
+ * arena_pool_free - Frees an element allocated from any shard of the pool,
+ *                   through any shard of it. Lock-free, and O(1), apart from
+ *                   answering a steal request.
+ */
+void* arena_pool_alloc(struct arena_shard*);
+void arena_pool_free(struct arena_shard*, void*);
@@ -0,0 +1,350 @@
+#define _DEFAULT_SOURCE // For clock_gettime.
+#include "arena_profile.h"
+#include "arena_config.h"
+
+#include <execinfo.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * Samples are grouped into buckets by stack, like tcmalloc does: a bucket
+ * counts every sample ever taken with its stack, and those still live. That's
+ * what the heap profile reports. Buckets are never freed; there's one per
+ * distinct sampled stack, which doesn't grow without bound in practice.
+ *
+ * Live samples are kept in a chained hash table on (arena, element), so that
+ * arena.c can drop them again. arena.c only calls in for elements it knows
+ * were sampled (it keeps a bit per element), so a free never looks anything
+ * up here unless it has to.
+ */
+
+struct bucket {
+    struct bucket* next;
+    uint64_t hash;
+    size_t   depth;
+    void*    stack[PROFILE_DEPTH];
+
+    size_t allocs, alloc_bytes; // Every sample ever taken.
+    size_t live, live_bytes;    // Samples still allocated.
+};
+
+struct sample {
+    struct sample*      next;
+    const struct arena* arena;
+    const void*         p;
+    size_t              size;
+    uint64_t            time;
+    struct bucket*      bucket;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t   rate = PROFILE_RATE;
+static uint64_t seed = 88172645463325252u;
+
+static struct bucket** buckets;     // Hashed by stack.
+static size_t          bucket_slots;
+static size_t          bucket_count;
+
+static struct sample** samples;     // Hashed by arena and element.
+static size_t          sample_slots;
+static size_t          sample_count;
+
+// splitmix64's finalizer.
+static inline uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t hash_stack(void* const* stack, size_t depth)
+{
+    uint64_t h = depth;
+
+    for(size_t i = 0; i < depth; ++i)
+        h = mix(h ^ (uint64_t)(uintptr_t)stack[i]);
+
+    return h;
+}
+
+static inline size_t sample_slot(const struct arena* a, const void* p, size_t slots)
+{
+    return (size_t)(mix((uint64_t)(uintptr_t)a ^ mix((uint64_t)(uintptr_t)p)) & (slots - 1));
+}
+
+// Tables are powers of two, and double once they have as many entries as
+// slots. These return false if out of memory.
+static bool grow_buckets(void)
+{
+    size_t n = bucket_slots == 0 ? 64 : 2*bucket_slots;
+
+    struct bucket** t = ALLOC(n*sizeof(struct bucket*));
+    if(t == NULL) return false;
+
+    memset(t, 0, n*sizeof(struct bucket*));
+
+    for(size_t i = 0; i < bucket_slots; ++i)
+        for(struct bucket *b = buckets[i], *next; b != NULL; b = next)
+        {
+            next = b->next;
+            b->next = t[b->hash & (n - 1)];
+            t[b->hash & (n - 1)] = b;
+        }
+
+    FREE(buckets);
+    buckets      = t;
+    bucket_slots = n;
+
+    return true;
+}
+
+static bool grow_samples(void)
+{
+    size_t n = sample_slots == 0 ? 64 : 2*sample_slots;
+
+    struct sample** t = ALLOC(n*sizeof(struct sample*));
+    if(t == NULL) return false;
+
+    memset(t, 0, n*sizeof(struct sample*));
+
+    for(size_t i = 0; i < sample_slots; ++i)
+        for(struct sample *s = samples[i], *next; s != NULL; s = next)
+        {
+            size_t slot = sample_slot(s->arena, s->p, n);
+
+            next = s->next;
+            s->next = t[slot];
+            t[slot] = s;
+        }
+
+    FREE(samples);
+    samples      = t;
+    sample_slots = n;
+
+    return true;
+}
+
+// Finds or makes the bucket for `stack'.
+static struct bucket* bucket_of(void* const* stack, size_t depth)
+{
+    uint64_t h = hash_stack(stack, depth);
+
+    if(bucket_slots != 0)
+        for(struct bucket* b = buckets[h & (bucket_slots - 1)]; b != NULL; b = b->next)
+            if(b->hash == h && b->depth == depth
+            && memcmp(b->stack, stack, depth*sizeof(void*)) == 0)
+                return b;
+
+    if(bucket_count >= bucket_slots && !grow_buckets())
+        return NULL;
+
+    struct bucket* b = ALLOC(sizeof(struct bucket));
+    if(b == NULL) return NULL;
+
+    memset(b, 0, sizeof(struct bucket));
+    memcpy(b->stack, stack, depth*sizeof(void*));
+    b->hash  = h;
+    b->depth = depth;
+
+    size_t s = h & (bucket_slots - 1);
+    b->next = buckets[s];
+    buckets[s] = b;
+    ++bucket_count;
+
+    return b;
+}
+
+static inline uint64_t now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000u + (uint64_t)t.tv_nsec;
+}
+
+void arena_profile_set_rate(size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+    rate = bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+size_t arena_profile_next(void)
+{
+    pthread_mutex_lock(&lock);
+
+    size_t mean = rate != 0 ? rate : PROFILE_RATE; // Keep checking back when off.
+    uint64_t r  = mix(seed += UINT64_C(0x9E3779B97F4A7C15));
+
+    pthread_mutex_unlock(&lock);
+
+    // An exponential variate, from a uniform one in (0, 1].
+    double u = ((double)(r >> 11) + 1) / 9007199254740992.0;
+    double n = -log(u) * (double)mean;
+
+    return n < 1 ? 1 : n >= (double)SIZE_MAX ? SIZE_MAX : (size_t)n;
+}
+
+// Adds a sample to its bucket and the table. Called with the lock held.
+static bool record(const struct arena* a, const void* p, size_t size,
+                   uint64_t time, void* const* stack, size_t depth)
+{
+    struct bucket* b = bucket_of(stack, depth);
+    if(b == NULL) return false;
+
+    if(sample_count >= sample_slots && !grow_samples())
+        return false;
+
+    struct sample* s = ALLOC(sizeof(struct sample));
+    if(s == NULL) return false;
+
+    *s = (struct sample) { .arena = a, .p = p, .size = size, .time = time, .bucket = b };
+
+    size_t slot = sample_slot(a, p, sample_slots);
+    s->next = samples[slot];
+    samples[slot] = s;
+    ++sample_count;
+
+    ++b->allocs;
+    ++b->live;
+    b->alloc_bytes += size;
+    b->live_bytes  += size;
+
+    return true;
+}
+
+// The most frames arena.c may have between arena_profile_take and its caller.
+#define MAX_SKIP 8
+
+bool arena_profile_take(const struct arena* a, const void* p, size_t size, const void* caller)
+{
+    // Before taking the lock: backtrace can be slow, and may allocate the
+    // first time around.
+    void* frames[PROFILE_DEPTH + MAX_SKIP];
+    int   got = backtrace(frames, PROFILE_DEPTH + MAX_SKIP);
+
+    // Skip to the caller's frame, or at least past this function's own.
+    size_t skip = got > 0 ? 1 : 0;
+
+    for(size_t i = 1; caller != NULL && i < MAX_SKIP && (int)i < got; ++i)
+        if(frames[i] == caller)
+        {
+            skip = i;
+            break;
+        }
+
+    size_t   depth = (size_t)got - skip;
+    uint64_t t     = now();
+
+    if(depth > PROFILE_DEPTH)
+        depth = PROFILE_DEPTH;
+
+    pthread_mutex_lock(&lock);
+    bool ok = rate != 0 && record(a, p, size, t, frames + skip, depth);
+    pthread_mutex_unlock(&lock);
+
+    return ok;
+}
+
+void arena_profile_drop(const struct arena* a, const void* p)
+{
+    pthread_mutex_lock(&lock);
+
+    if(sample_slots != 0)
+        for(struct sample** c = &samples[sample_slot(a, p, sample_slots)]; *c != NULL; c = &(*c)->next)
+            if((*c)->arena == a && (*c)->p == p)
+            {
+                struct sample* s = *c;
+                *c = s->next;
+                --sample_count;
+
+                --s->bucket->live;
+                s->bucket->live_bytes -= s->size;
+
+                FREE(s);
+                break;
+            }
+
+    pthread_mutex_unlock(&lock);
+}
+
+void arena_profile_visit(void (*fn)(const struct arena_sample*, void* ctx), void* ctx)
+{
+    pthread_mutex_lock(&lock);
+
+    for(size_t i = 0; i < sample_slots; ++i)
+        for(struct sample* s = samples[i]; s != NULL; s = s->next)
+        {
+            struct arena_sample v = {
+                .arena = s->arena,
+                .p     = s->p,
+                .size  = s->size,
+                .time  = s->time,
+                .depth = s->bucket->depth,
+                .stack = s->bucket->stack
+            };
+
+            fn(&v, ctx);
+        }
+
+    pthread_mutex_unlock(&lock);
+}
+
+// Appends /proc/self/maps, which pprof needs to symbolize the addresses.
+static void dump_maps(FILE* f)
+{
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps == NULL) return;
+
+    char   buf[4096];
+    size_t n;
+
+    fputs("\nMAPPED_LIBRARIES:\n", f);
+
+    while((n = fread(buf, 1, sizeof(buf), maps)) != 0)
+        fwrite(buf, 1, n, f);
+
+    fclose(maps);
+}
+
+bool arena_profile_dump(FILE* f)
+{
+    pthread_mutex_lock(&lock);
+
+    size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+
+    for(size_t i = 0; i < bucket_slots; ++i)
+        for(struct bucket* b = buckets[i]; b != NULL; b = b->next)
+        {
+            live        += b->live;
+            live_bytes  += b->live_bytes;
+            allocs      += b->allocs;
+            alloc_bytes += b->alloc_bytes;
+        }
+
+    // heap_v2 counts are of samples; pprof scales them back up by the rate.
+    fprintf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live, live_bytes, allocs, alloc_bytes, rate != 0 ? rate : PROFILE_RATE);
+
+    for(size_t i = 0; i < bucket_slots; ++i)
+        for(struct bucket* b = buckets[i]; b != NULL; b = b->next)
+        {
+            fprintf(f, "%zu: %zu [%zu: %zu] @", b->live, b->live_bytes,
+                    b->allocs, b->alloc_bytes);
+
+            for(size_t k = 0; k < b->depth; ++k)
+                fprintf(f, " 0x%" PRIxPTR, (uintptr_t)b->stack[k]);
+
+            fputc('\n', f);
+        }
+
+    pthread_mutex_unlock(&lock);
+
+    dump_maps(f);
+    return fflush(f) == 0 && !ferror(f);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A sampling heap profiler for arenas, in the style of tcmalloc's: which call
+ * sites fill the arenas, and which hold on to their elements longest.
+ *
+ * Tracing every allocation would cost far too much, so each arena picks one
+ * allocation roughly every `rate' bytes it hands out, at exponentially
+ * distributed intervals (a Poisson process over bytes allocated). A sampled
+ * allocation records its stack, when it happened and which element it got,
+ * and is dropped again when the element is freed, or thrown away by
+ * arena_reset or arena_rollback_to. Between samples, an allocation costs a
+ * subtraction and a free a well-predicted branch.
+ *
+ * Only built into arena.c when ARENA_PROFILE is defined (see arena_config.h);
+ * otherwise nothing is ever sampled. The atomic variants aren't sampled
+ * either way. Samples are kept in a table of their own, behind a lock, so the
+ * functions below are safe to call from any thread while other threads
+ * allocate.
+ */
+
+/*
+ * arena_profile_set_rate - Sets the mean number of bytes between samples,
+ *                          PROFILE_RATE by default. 0 turns sampling off.
+ *                          Each arena picks the new rate up at its next
+ *                          sample; while sampling is off, arenas still check
+ *                          back about every PROFILE_RATE bytes.
+ */
+void arena_profile_set_rate(size_t bytes);
+
+/*
+ * arena_profile_dump - Writes a heap profile of the sampled elements still
+ *                      allocated, in the legacy text format pprof reads
+ *                      (`pprof --text ./program heap.prof'). Returns false
+ *                      if writing failed.
+ */
+bool arena_profile_dump(FILE* f);
+
+/*
+ * arena_profile_visit - Calls fn(sample, ctx) for every sampled element still
+ *                       allocated, in no particular order. The lock is held
+ *                       meanwhile, so fn mustn't allocate from an arena.
+ */
+struct arena_sample {
+    const struct arena* arena;
+    const void*  p;       // The element.
+    size_t       size;    // Its size.
+    uint64_t     time;    // When it was allocated, in CLOCK_MONOTONIC ns.
+    size_t       depth;   // The number of frames in `stack'.
+    void* const* stack;   // Return addresses, innermost first, from the
+                          // function which called into the arena on.
+};
+
+void arena_profile_visit(void (*fn)(const struct arena_sample*, void* ctx), void* ctx);
+
+/*
+ * Hooks for arena.c, which calls them from the slow paths only.
+ *
+ * arena_profile_next - Returns the number of bytes until an arena's next
+ *                      sample.
+ *
+ * arena_profile_take - Records a sample of `p', which `a' just allocated,
+ *                      with the stack from `caller' on: the return address
+ *                      of the arena function called, so that the sample's
+ *                      stack starts in whoever called it. With NULL, the
+ *                      stack starts at arena_profile_take's caller instead.
+ *                      Returns false if it couldn't be recorded.
+ *
+ * arena_profile_drop - Forgets the sample of `p', which `a' no longer has
+ *                      allocated.
+ */
+size_t arena_profile_next(void);
+bool arena_profile_take(const struct arena* a, const void* p, size_t size, const void* caller);
+void arena_profile_drop(const struct arena* a, const void* p);
@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include "arena_mt.h"
+#include "arena_pool.h"
+
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks arena_alloc and friends against the system allocator, and
+ * against jemalloc and tcmalloc when their shared libraries can be found.
+ *
+ * Usage: [BENCH_OPS=n] ./bench [filter]
+ *
+ * Only benchmarks whose name contains `filter' are run, and each measurement
+ * does about BENCH_OPS operations (20 million by default). Every line reports
+ * nanoseconds, cycles and last-level cache misses per operation, where an
+ * operation is one allocation or one free. Cycles and cache misses come from
+ * perf_event_open, and are reported as "-" if it isn't permitted.
+ *
+ * Every allocator is called through the same function pointers, so the call
+ * overhead is the same for all of them.
+ */
+
+/*** Allocators under test ***/
+
+struct subject {
+    const char* name;
+    void* (*init)(size_t size, size_t count); // Returns a shared context.
+    void* (*thread)(void* ctx);               // Returns a per-thread context.
+    void  (*unthread)(void* tctx);
+    void* (*alloc)(void* tctx);
+    void  (*free)(void* tctx, void* p);
+    void  (*reset)(void* ctx, void** live, size_t n); // Frees everything.
+    void  (*destroy)(void* ctx);
+};
+
+static void* same(void* ctx)    { return ctx; }
+static void  nothing(void* ctx) { (void)ctx; }
+
+// Frees everything one element at a time, for allocators without a reset.
+#define RESET_BY_FREEING(f) \
+    static void f##_reset(void* ctx, void** live, size_t n) \
+    { \
+        for(size_t i = 0; i < n; ++i) f##_free(ctx, live[i]); \
+    }
+
+static void* plain_init(size_t size, size_t count) { return arena_init(size, count); }
+static void* plain_alloc(void* a)                  { return arena_alloc(a); }
+static void  plain_free(void* a, void* p)          { arena_free(a, p); }
+static void  plain_destroy(void* a)                { arena_destroy(a); }
+static void  plain_reset(void* a, void** live, size_t n)
+{
+    (void)live; (void)n;
+    arena_reset(a);
+}
+
+static void* atomic_alloc(void* a)                 { return arena_alloc_atomic(a); }
+static void  atomic_free(void* a, void* p)         { arena_free_atomic(a, p); }
+
+// An arena behind one global lock, which is what callers had to do before
+// there was a concurrent mode.
+struct locked {
+    pthread_mutex_t lock;
+    struct arena* a;
+};
+
+static void* locked_init(size_t size, size_t count)
+{
+    struct locked* l = malloc(sizeof(struct locked));
+    pthread_mutex_init(&l->lock, NULL);
+    l->a = arena_init(size, count);
+    return l;
+}
+
+static void* locked_alloc(void* ctx)
+{
+    struct locked* l = ctx;
+    pthread_mutex_lock(&l->lock);
+    void* p = arena_alloc(l->a);
+    pthread_mutex_unlock(&l->lock);
+    return p;
+}
+
+static void locked_free(void* ctx, void* p)
+{
+    struct locked* l = ctx;
+    pthread_mutex_lock(&l->lock);
+    arena_free(l->a, p);
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void locked_reset(void* ctx, void** live, size_t n)
+{
+    (void)live; (void)n;
+    arena_reset(((struct locked*)ctx)->a);
+}
+
+static void locked_destroy(void* ctx)
+{
+    struct locked* l = ctx;
+    pthread_mutex_destroy(&l->lock);
+    arena_destroy(l->a);
+    free(l);
+}
+
+static void* mt_init(size_t size, size_t count) { return arena_mt_init(size, count); }
+static void  mt_destroy(void* d)                { arena_mt_destroy(d); }
+
+static void* mag_thread(void* d)
+{
+    struct magazine* m = malloc(sizeof(struct magazine));
+    magazine_init(m, d);
+    return m;
+}
+
+static void mag_unthread(void* m)
+{
+    magazine_destroy(m);
+    free(m);
+}
+
+static void* mag_alloc(void* m)         { return magazine_alloc(m); }
+static void  mag_free(void* m, void* p) { magazine_free(m, p); }
+
+// Magazines cache pointers, so a reset has to go through them.
+static void mag_reset(void* d, void** live, size_t n)
+{
+    struct magazine m;
+    magazine_init(&m, d);
+
+    for(size_t i = 0; i < n; ++i)
+        magazine_free(&m, live[i]);
+
+    magazine_destroy(&m);
+}
+
+// Every shard can hold `count' elements, so that a single thread gets as many
+// as from the other subjects. There are enough shards for every thread of
+// bench_threads.
+static size_t pool_shards(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : 2*(size_t)cpus < 64 ? 2*(size_t)cpus : 64;
+}
+
+static void* pool_init(size_t size, size_t count) { return arena_pool_init(size, count, pool_shards()); }
+static void* pool_thread(void* p)                 { return arena_pool_join(p); }
+static void  pool_unthread(void* s)               { arena_pool_leave(s); }
+static void* pool_alloc(void* s)                  { return arena_pool_alloc(s); }
+static void  pool_free(void* s, void* p)          { arena_pool_free(s, p); }
+static void  pool_destroy(void* p)                { arena_pool_destroy(p); }
+
+static void pool_reset(void* p, void** live, size_t n)
+{
+    struct arena_shard* s = arena_pool_join(p);
+
+    for(size_t i = 0; i < n; ++i)
+        arena_pool_free(s, live[i]);
+
+    arena_pool_leave(s);
+}
+
+// A malloc-like context is just the size to allocate.
+static void* (*je_mallocx)(size_t, int);
+static void  (*je_dallocx)(void*, int);
+static void* (*tc_malloc)(size_t);
+static void  (*tc_free)(void*);
+
+static void* sys_init(size_t size, size_t count) { (void)count; return (void*)size; }
+static void* sys_alloc(void* size)               { return malloc((size_t)size); }
+static void  sys_free(void* size, void* p)       { (void)size; free(p); }
+RESET_BY_FREEING(sys)
+
+static void* je_alloc(void* size)                { return je_mallocx((size_t)size, 0); }
+static void  je_free(void* size, void* p)        { (void)size; je_dallocx(p, 0); }
+RESET_BY_FREEING(je)
+
+static void* tcm_alloc(void* size)               { return tc_malloc((size_t)size); }
+static void  tcm_free(void* size, void* p)       { (void)size; tc_free(p); }
+RESET_BY_FREEING(tcm)
+
+#define SUBJECT(n, init, thr, unthr, al, fr, rs, de) \
+    { n, init, thr, unthr, al, fr, rs, de }
+
+static struct subject subjects[] = {
+    SUBJECT("arena",    plain_init,  same,        nothing,       plain_alloc,  plain_free,  plain_reset,  plain_destroy),
+    SUBJECT("atomic",   plain_init,  same,        nothing,       atomic_alloc, atomic_free, plain_reset,  plain_destroy),
+    SUBJECT("locked",   locked_init, same,        nothing,       locked_alloc, locked_free, locked_reset, locked_destroy),
+    SUBJECT("magazine", mt_init,     mag_thread,  mag_unthread,  mag_alloc,    mag_free,    mag_reset,    mt_destroy),
+    SUBJECT("pool",     pool_init,   pool_thread, pool_unthread, pool_alloc,   pool_free,   pool_reset,   pool_destroy),
+    SUBJECT("malloc",   sys_init,    same,        nothing,       sys_alloc,    sys_free,    sys_reset,    nothing),
+    SUBJECT("jemalloc", sys_init,    same,        nothing,       je_alloc,     je_free,     je_reset,     nothing),
+    SUBJECT("tcmalloc", sys_init,    same,        nothing,       tcm_alloc,    tcm_free,    tcm_reset,    nothing),
+};
+
+#define NSUBJECTS (sizeof(subjects)/sizeof(subjects[0]))
+
+static bool subject_available(const struct subject* s)
+{
+    if(strcmp(s->name, "jemalloc") == 0) return je_mallocx != NULL;
+    if(strcmp(s->name, "tcmalloc") == 0) return tc_malloc != NULL;
+    return true;
+}
+
+// Looks up `sym' in the first of `libs' that can be loaded.
+static void* find(const char* const* libs, const char* sym)
+{
+    for(; *libs != NULL; ++libs)
+    {
+        void* h = dlopen(*libs, RTLD_NOW | RTLD_LOCAL);
+        void* f = h != NULL ? dlsym(h, sym) : NULL;
+        if(f != NULL) return f;
+    }
+
+    return NULL;
+}
+
+static void load_allocators(void)
+{
+    static const char* const je[] = { "libjemalloc.so.2", "libjemalloc.so", NULL };
+    static const char* const tc[] = { "libtcmalloc.so.4", "libtcmalloc_minimal.so.4",
+                                      "libtcmalloc.so", NULL };
+
+    // mallocx and dallocx don't clash with libc, so they can't be confused
+    // with the system allocator's malloc and free.
+    *(void**)&je_mallocx = find(je, "mallocx");
+    *(void**)&je_dallocx = find(je, "dallocx");
+    *(void**)&tc_malloc  = find(tc, "tc_malloc");
+    *(void**)&tc_free    = find(tc, "tc_free");
+
+    if(je_dallocx == NULL) je_mallocx = NULL;
+    if(tc_free    == NULL) tc_malloc  = NULL;
+}
+
+/*** Measurement ***/
+
+struct counters {
+    int cycles; // perf_event_open file descriptors, or -1.
+    int misses;
+};
+
+static int open_counter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.inherit        = 1; // Count the worker threads too.
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static struct counters counters;
+
+static void start(struct timespec* t)
+{
+    if(counters.cycles >= 0) ioctl(counters.cycles, PERF_EVENT_IOC_RESET, 0);
+    if(counters.misses >= 0) ioctl(counters.misses, PERF_EVENT_IOC_RESET, 0);
+    if(counters.cycles >= 0) ioctl(counters.cycles, PERF_EVENT_IOC_ENABLE, 0);
+    if(counters.misses >= 0) ioctl(counters.misses, PERF_EVENT_IOC_ENABLE, 0);
+    clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+static double elapsed_ns(const struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec)*1e9 + (double)(t1.tv_nsec - t0->tv_nsec);
+}
+
+static double read_counter(int fd)
+{
+    uint64_t v;
+
+    if(fd < 0) return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    return read(fd, &v, sizeof(v)) == sizeof(v) ? (double)v : -1;
+}
+
+static void report(const char* bench, const struct subject* s, size_t size,
+                   size_t count, unsigned threads, const struct timespec* t0,
+                   double ops)
+{
+    double ns     = elapsed_ns(t0);
+    double cycles = read_counter(counters.cycles);
+    double misses = read_counter(counters.misses);
+
+    printf("%-8s %-9s size=%-5zu count=%-8zu threads=%-3u %9.2f ns/op",
+           bench, s->name, size, count, threads, ns/ops);
+
+    if(cycles >= 0) printf(" %9.1f cycles/op", cycles/ops);
+    else            printf(" %9s cycles/op", "-");
+
+    if(misses >= 0) printf(" %9.4f misses/op\n", misses/ops);
+    else            printf(" %9s misses/op\n", "-");
+
+    fflush(stdout);
+}
+
+// Keeps the compiler from optimizing writes to allocated memory away.
+static inline void touch(void* p)
+{
+    *(volatile char*)p = 1;
+}
+
+// xorshift64, for reproducible churn.
+static inline uint64_t next_random(uint64_t* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/*** Benchmarks ***/
+
+// Total operations per measurement, roughly. Big enough to amortize setup.
+static size_t OPS = 20000000;
+
+// Allocates and immediately frees one element, over and over.
+static void bench_pair(const struct subject* s, size_t size, size_t count)
+{
+    void* ctx = s->init(size, count);
+    void* t   = s->thread(ctx);
+    size_t n  = OPS/2;
+    struct timespec t0;
+
+    start(&t0);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        void* p = s->alloc(t);
+        touch(p);
+        s->free(t, p);
+    }
+
+    report("pair", s, size, count, 1, &t0, 2.0*(double)n);
+    s->unthread(t);
+    s->destroy(ctx);
+}
+
+// Allocates every element, then frees every element.
+static void bench_fill(const struct subject* s, size_t size, size_t count)
+{
+    void* ctx   = s->init(size, count);
+    void* t     = s->thread(ctx);
+    void** live = malloc(count*sizeof(void*));
+    size_t rounds = OPS/(2*count) + 1;
+    struct timespec t0;
+
+    start(&t0);
+
+    for(size_t r = 0; r < rounds; ++r)
+    {
+        for(size_t i = 0; i < count; ++i)
+            touch(live[i] = s->alloc(t));
+
+        for(size_t i = 0; i < count; ++i)
+            s->free(t, live[i]);
+    }
+
+    report("fill", s, size, count, 1, &t0, 2.0*(double)(rounds*count));
+    free(live);
+    s->unthread(t);
+    s->destroy(ctx);
+}
+
+// Starting half full, frees or allocates a random slot every step, so the
+// free list ends up thoroughly shuffled.
+static void bench_churn(const struct subject* s, size_t size, size_t count)
+{
+    void* ctx   = s->init(size, count);
+    void* t     = s->thread(ctx);
+    void** live = calloc(count, sizeof(void*));
+    uint64_t rng = 88172645463325252u;
+    size_t n = OPS;
+    struct timespec t0;
+
+    for(size_t i = 0; i < count; i += 2)
+        live[i] = s->alloc(t);
+
+    start(&t0);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t k = (size_t)(next_random(&rng) % count);
+
+        if(live[k] != NULL)
+        {
+            s->free(t, live[k]);
+            live[k] = NULL;
+        }
+        else
+            touch(live[k] = s->alloc(t));
+    }
+
+    report("churn", s, size, count, 1, &t0, (double)n);
+
+    for(size_t i = 0; i < count; ++i)
+        if(live[i] != NULL) s->free(t, live[i]);
+
+    free(live);
+    s->unthread(t);
+    s->destroy(ctx);
+}
+
+// Frees every element in a random order, so the free list jumps all over the
+// buffer, then reallocates and initializes every element, over and over. Each
+// round frees what it allocated in allocation order, which keeps the list as
+// scattered as it started. Once the buffer is bigger than the cache, every
+// pop from the free list misses, unless ARENA_PREFETCH hides it behind the
+// initialization.
+static void bench_scatter(const struct subject* s, size_t size, size_t count)
+{
+    void* ctx   = s->init(size, count);
+    void* t     = s->thread(ctx);
+    void** live = malloc(count*sizeof(void*));
+    uint64_t rng = 88172645463325252u;
+    size_t rounds = OPS/(2*count) + 1;
+    struct timespec t0;
+
+    for(size_t i = 0; i < count; ++i)
+        live[i] = s->alloc(t);
+
+    // Fisher-Yates.
+    for(size_t i = count; i > 1; --i)
+    {
+        size_t k = (size_t)(next_random(&rng) % i);
+        void* p  = live[i - 1];
+        live[i - 1] = live[k];
+        live[k] = p;
+    }
+
+    for(size_t i = 0; i < count; ++i)
+        s->free(t, live[i]);
+
+    start(&t0);
+
+    for(size_t r = 0; r < rounds; ++r)
+    {
+        for(size_t i = 0; i < count; ++i)
+        {
+            uint64_t* p = live[i] = s->alloc(t);
+
+            // Stands in for constructing the object: a little arithmetic,
+            // the result of which goes in its first word.
+            uint64_t x = i + 1;
+            for(int k = 0; k < 16; ++k) next_random(&x);
+            *p = x;
+        }
+
+        for(size_t i = 0; i < count; ++i)
+            s->free(t, live[i]);
+    }
+
+    report("scatter", s, size, count, 1, &t0, 2.0*(double)(rounds*count));
+    free(live);
+    s->unthread(t);
+    s->destroy(ctx);
+}
+
+// Allocates every element, then throws them all away at once. For the
+// general purpose allocators, that means freeing them one by one.
+static void bench_reset(const struct subject* s, size_t size, size_t count)
+{
+    void* ctx   = s->init(size, count);
+    void* t     = s->thread(ctx);
+    void** live = malloc(count*sizeof(void*));
+    size_t rounds = OPS/count + 1;
+    struct timespec t0;
+
+    start(&t0);
+
+    for(size_t r = 0; r < rounds; ++r)
+    {
+        for(size_t i = 0; i < count; ++i)
+            touch(live[i] = s->alloc(t));
+
+        s->unthread(t);
+        s->reset(ctx, live, count);
+        t = s->thread(ctx);
+    }
+
+    // Only allocations count as operations here; the reset is their cost.
+    report("reset", s, size, count, 1, &t0, (double)(rounds*count));
+    free(live);
+    s->unthread(t);
+    s->destroy(ctx);
+}
+
+struct worker {
+    const struct subject* s;
+    void*  ctx;
+    size_t n;
+    pthread_barrier_t* go;
+};
+
+#define BURST 32
+
+static void* work(void* arg)
+{
+    struct worker* w = arg;
+    void* t = w->s->thread(w->ctx);
+    void* live[BURST];
+
+    pthread_barrier_wait(w->go);
+
+    for(size_t i = 0; i < w->n; i += 2*BURST)
+    {
+        for(size_t k = 0; k < BURST; ++k)
+            touch(live[k] = w->s->alloc(t));
+
+        for(size_t k = 0; k < BURST; ++k)
+            w->s->free(t, live[k]);
+    }
+
+    w->s->unthread(t);
+    return NULL;
+}
+
+// Every thread allocates and frees bursts of elements from one shared
+// allocator. Throughput is reported as the wall-clock time per operation,
+// across all threads.
+static void bench_threads(const struct subject* s, size_t size, size_t count, unsigned threads)
+{
+    // Plain arenas aren't thread safe.
+    if(s->alloc == plain_alloc && threads > 1)
+        return;
+
+    void* ctx = s->init(size, count);
+    pthread_t tid[threads];
+    struct worker w[threads];
+    pthread_barrier_t go;
+    struct timespec t0;
+
+    pthread_barrier_init(&go, NULL, threads + 1);
+
+    for(unsigned i = 0; i < threads; ++i)
+    {
+        w[i] = (struct worker) { s, ctx, OPS/threads, &go };
+        pthread_create(&tid[i], NULL, work, &w[i]);
+    }
+
+    start(&t0);
+    pthread_barrier_wait(&go);
+
+    for(unsigned i = 0; i < threads; ++i)
+        pthread_join(tid[i], NULL);
+
+    report("threads", s, size, count, threads, &t0, (double)OPS);
+    pthread_barrier_destroy(&go);
+    s->destroy(ctx);
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t sizes[]  = { 16, 64, 256 };
+    static const size_t counts[] = { 1024, 1024*1024 };
+    const char* filter = argc > 1 ? argv[1] : "";
+
+    static const struct {
+        const char* name;
+        void (*run)(const struct subject*, size_t, size_t);
+    } benches[] = {
+        { "pair", bench_pair }, { "fill", bench_fill },
+        { "churn", bench_churn }, { "scatter", bench_scatter },
+        { "reset", bench_reset },
+    };
+
+    if(getenv("BENCH_OPS") != NULL)
+        OPS = strtoul(getenv("BENCH_OPS"), NULL, 10);
+
+    load_allocators();
+    counters.cycles = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+    counters.misses = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+
+    for(size_t b = 0; b < sizeof(benches)/sizeof(benches[0]); ++b)
+    {
+        if(strstr(benches[b].name, filter) == NULL) continue;
+
+        for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+        for(size_t j = 0; j < sizeof(counts)/sizeof(counts[0]); ++j)
+        for(size_t k = 0; k < NSUBJECTS; ++k)
+            if(subject_available(&subjects[k]))
+                benches[b].run(&subjects[k], sizes[i], counts[j]);
+    }
+
+    if(strstr("threads", filter) != NULL)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for(unsigned t = 1; t <= 2*(unsigned)cpus && t <= 64; t *= 2)
+        for(size_t k = 0; k < NSUBJECTS; ++k)
+            if(subject_available(&subjects[k]))
+                bench_threads(&subjects[k], 64, 1024*1024, t);
+    }
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+/*
+ * Bit twiddling shared by everything which keeps one bit per element. Not part
+ * of the public interface.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __AVX2__
+    #include <immintrin.h>
+#endif
+
+// How many elements ahead of the visitor iteration prefetches.
+#define PREFETCH_DISTANCE 4
+
+// The number of 64-bit words needed to hold `bits' bits.
+static inline size_t words_for(size_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+static inline bool test_bit(const uint64_t* bm, size_t i)
+{
+    return bm[i/64] >> i % 64 & 1;
+}
+
+static inline size_t lowest_bit(uint64_t w)
+{
+    return (size_t)__builtin_ctzll(w);
+}
+
+// Returns the index of the first nonzero word in w[i, n), or n if all of them
+// are zero.
+static inline size_t first_nonzero(const uint64_t* w, size_t i, size_t n)
+{
+#ifdef __AVX2__
+    for(; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(w + i));
+        if(!_mm256_testz_si256(v, v))
+            break;
+    }
+#endif
+
+    while(i < n && w[i] == 0)
+        ++i;
+
+    return i;
+}
+
+// Returns the index of the first clear bit of `bm' in [i, end), or `end'.
+static inline size_t next_clear(const uint64_t* bm, size_t i, size_t end)
+{
+    while(i < end)
+    {
+        uint64_t w = ~bm[i/64] >> i % 64;
+
+        if(w != 0)
+        {
+            i += lowest_bit(w);
+            return i < end ? i : end;
+        }
+
+        i = (i/64 + 1)*64;
+    }
+
+    return end;
+}
+
+/*
+ * Calls fn(base + i*size, ctx) for every i in [begin, end) whose bit in `bm'
+ * is clear, in increasing order, prefetching PREFETCH_DISTANCE elements
+ * ahead of the one being visited.
+ */
+static inline void visit_clear(const uint64_t* bm, size_t begin, size_t end,
+                               char* base, size_t size,
+                               void (*fn)(void* obj, void* ctx), void* ctx)
+{
+    size_t ahead[PREFETCH_DISTANCE];
+    size_t next = begin;
+
+    // Fill the window...
+    for(size_t k = 0; k < PREFETCH_DISTANCE; ++k)
+    {
+        next = ahead[k] = next_clear(bm, next, end);
+        if(next < end)
+            __builtin_prefetch(base + next*size);
+        next += next < end;
+    }
+
+    // ...then slide it along.
+    for(size_t k = 0; ahead[k] < end; k = (k + 1) % PREFETCH_DISTANCE)
+    {
+        size_t i = ahead[k];
+
+        next = ahead[k] = next_clear(bm, next, end);
+        if(next < end)
+            __builtin_prefetch(base + next*size);
+        next += next < end;
+
+        fn(base + i*size, ctx);
+    }
+}
@@ -0,0 +1,202 @@
+#define _DEFAULT_SOURCE // For madvise.
+
+#include "bitmap_arena.h"
+#include "arena_config.h"
+#include "bitmap.h"
+
+#include <string.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * Bit i of `bits' is set iff object i is free. Bit j of `summary' is set iff
+ * word j of `bits' is nonzero, i.e. iff any of objects [64j, 64j + 64) is free.
+ *
+ * To allocate, find the first nonzero summary word (starting at `hint', below
+ * which every summary word is known to be zero), find its lowest set bit with
+ * tzcnt, then do the same for the word of `bits' it points to. Clear the bit,
+ * and clear the summary bit too if that emptied the word.
+ *
+ * To free, set both bits back.
+ */
+
+struct bitmap_arena {
+    size_t size;   // The distance between objects: their size, rounded up.
+    size_t count;  // The number of objects in the buffer.
+    size_t nwords; // The number of words in `bits'.
+    size_t nsum;   // The number of words in `summary'.
+    size_t hint;   // No word of `summary' below this one has a bit set.
+
+    uint64_t* bits;    // One bit per object. Set if free.
+    uint64_t* summary; // One bit per word of `bits'. Set if it's nonzero.
+    char*     buffer;  // Points to the raw arena buffer.
+    char*     bufend;  // Points one past the last object in the buffer.
+};
+
+// Objects are placed a multiple of a pointer's size apart, so that with the
+// header and bitmaps being whole words too, every one of them is aligned.
+static inline size_t stride(size_t size)
+{
+    return (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+}
+
+size_t bitmap_arena_footprint(size_t size, size_t count)
+{
+    size_t nwords = words_for(count);
+
+    return sizeof(struct bitmap_arena)
+         + (nwords + words_for(nwords))*sizeof(uint64_t)
+         + stride(size)*count;
+}
+
+struct bitmap_arena* bitmap_arena_init(size_t size, size_t count)
+{
+    size_t allocated = bitmap_arena_footprint(size, count);
+
+    void* buf = ALLOC(allocated);
+    if(buf == NULL) return NULL;
+
+    return bitmap_arena_init_(size, count, buf, allocated);
+}
+
+struct bitmap_arena* bitmap_arena_init_(size_t size, size_t count, void* mem, size_t len)
+{
+    if(size == 0 || len < bitmap_arena_footprint(size, count))
+        return NULL;
+
+    struct bitmap_arena* a = mem;
+    size_t nwords = words_for(count);
+    size_t nsum   = words_for(nwords);
+    uint64_t* bits = (uint64_t*)(a + 1);
+    char* buf = (char*)(bits + nwords + nsum);
+
+    size = stride(size);
+
+    *a = (struct bitmap_arena) {
+        .size    = size,
+        .count   = count,
+        .nwords  = nwords,
+        .nsum    = nsum,
+        .bits    = bits,
+        .summary = bits + nwords,
+        .buffer  = buf,
+        .bufend  = buf + size*count
+    };
+
+    bitmap_arena_reset(a);
+
+    return a;
+}
+
+// Sets the first `n' bits of `w', and clears the rest of its last word.
+static void fill(uint64_t* w, size_t n)
+{
+    memset(w, 0xFF, n/64*sizeof(uint64_t));
+
+    if(n % 64 != 0)
+        w[n/64] = (UINT64_C(1) << n % 64) - 1;
+}
+
+void bitmap_arena_reset(struct bitmap_arena* a)
+{
+    fill(a->bits, a->count);
+    fill(a->summary, a->nwords);
+    a->hint = 0;
+}
+
+void* bitmap_arena_alloc(struct bitmap_arena* a)
+{
+    size_t s = a->hint = first_nonzero(a->summary, a->hint, a->nsum);
+
+    // Oh no we're out of free objects!
+    if(s == a->nsum) return NULL;
+
+    size_t w = s*64 + lowest_bit(a->summary[s]);
+    size_t i = w*64 + lowest_bit(a->bits[w]);
+
+    // Clear the lowest set bit.
+    if((a->bits[w] &= a->bits[w] - 1) == 0)
+        a->summary[s] &= a->summary[s] - 1;
+
+    return a->buffer + i*a->size;
+}
+
+// Returns true if n is in the interval [low, high)
+static inline bool in_range(const void* low, const void* n, const void* high)
+{
+    return low <= n && n < high;
+}
+
+void bitmap_arena_free(struct bitmap_arena* a, void* p)
+{
+    if(p == NULL) return;
+
+    if(!in_range(a->buffer, p, a->bufend))
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    size_t off = (size_t)((char*)p - a->buffer);
+    size_t i   = off / a->size;
+
+    if(off % a->size != 0)
+        error("Trying to free a pointer into the middle of an object.");
+
+    uint64_t bit = UINT64_C(1) << i % 64;
+    size_t   w   = i / 64;
+
+    if(a->bits[w] & bit)
+        error("Double-free detected.");
+
+    a->bits[w] |= bit;
+    a->summary[w / 64] |= UINT64_C(1) << w % 64;
+
+    if(w / 64 < a->hint)
+        a->hint = w / 64;
+}
+
+void bitmap_arena_foreach_live(struct bitmap_arena* a, size_t begin, size_t end,
+                               arena_visitor fn, void* ctx)
+{
+    if(end > a->count) end = a->count;
+
+    // Free objects have their bit set, so live ones are the clear bits.
+    if(begin < end)
+        visit_clear(a->bits, begin, end, a->buffer, a->size, fn, ctx);
+}
+
+size_t bitmap_arena_trim(struct bitmap_arena* a)
+{
+    size_t bytes = 0;
+    char*  run   = NULL; // The start of the current run of free pages.
+    char*  p     = (char*)(((uintptr_t)a->buffer + PAGE - 1) & ~(uintptr_t)(PAGE - 1));
+
+    // Nothing is ever written into free objects, so there's nothing to
+    // unlink: any page with only free objects on it can go.
+    for(; p + PAGE <= a->bufend; p += PAGE)
+    {
+        size_t first = (size_t)(p - a->buffer) / a->size;
+        size_t last  = (size_t)(p + PAGE - 1 - a->buffer) / a->size;
+        bool   free  = next_clear(a->bits, first, last + 1) == last + 1;
+
+        if(free && run == NULL) run = p;
+        if(!free && run != NULL)
+        {
+            bytes += release_pages(run, p);
+            run = NULL;
+        }
+    }
+
+    if(run != NULL)
+        bytes += release_pages(run, p);
+
+    return bytes;
+}
+
+size_t bitmap_arena_count(struct bitmap_arena* a)
+{
+    return a->count;
+}
+
+void bitmap_arena_destroy(struct bitmap_arena* a)
+{
+    FREE(a);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "arena.h"
+
+/*
+ * A bitmap arena answers saucetenuto's question literally: every object costs
+ * one bit in a packed occupancy bitmap (plus one bit per 64 objects for a
+ * summary level on top of it), and nothing is ever written into freed memory.
+ *
+ * That makes it the arena of choice when freed objects shouldn't be touched:
+ * their cache lines stay clean, and pages which only hold freed objects can be
+ * handed back to the OS.
+ *
+ * arena_alloc and arena_free are O(1) for up to 4096 objects. Past that,
+ * allocation scans one bit per 64 objects of the summary level, four words at
+ * a time with AVX2 when available. Freeing is always O(1), and also detects
+ * double-frees in O(1).
+ */
+struct bitmap_arena;
+
+/*
+ * bitmap_arena_init, bitmap_arena_init_ - The same as arena_init and
+ *                                         arena_init_. When using
+ *                                         bitmap_arena_init_, `len' must be
+ *                                         at least bitmap_arena_footprint.
+ *                                         Sizes are rounded up to a multiple
+ *                                         of sizeof(void*), to keep objects
+ *                                         aligned.
+ *
+ * bitmap_arena_footprint - The number of bytes needed to hold a bitmap arena
+ *                          of `count' elements of size `size', header and
+ *                          bitmap included.
+ */
+struct bitmap_arena* bitmap_arena_init(size_t size, size_t count);
+struct bitmap_arena* bitmap_arena_init_(size_t size, size_t count, void* mem, size_t len);
+size_t bitmap_arena_footprint(size_t size, size_t count);
+
+// Unlike arena_reset, this is O(count/64).
+void bitmap_arena_reset(struct bitmap_arena*);
+
+void* bitmap_arena_alloc(struct bitmap_arena*);
+void bitmap_arena_free(struct bitmap_arena*, void*);
+
+/*
+ * bitmap_arena_foreach_live - Calls `fn' on every live object with an index
+ *                             in [begin, end), in address order. Objects must
+ *                             not be allocated or freed meanwhile, but
+ *                             disjoint ranges may be visited in parallel.
+ *                             Pass 0 and SIZE_MAX to visit them all.
+ *
+ * bitmap_arena_count - The number of objects the arena holds, for splitting
+ *                      it up into ranges.
+ */
+void bitmap_arena_foreach_live(struct bitmap_arena*, size_t begin, size_t end,
+                               arena_visitor fn, void* ctx);
+size_t bitmap_arena_count(struct bitmap_arena*);
+
+/*
+ * bitmap_arena_trim - Hands every page which holds nothing but free objects
+ *                     back to the OS, like arena_trim, and returns how many
+ *                     bytes that was. Since free objects are never written
+ *                     to, this needs no extra memory and the pages stay
+ *                     untouched until objects on them are allocated again.
+ *                     Pages handed back by an earlier trim count again.
+ *                     O(count/64).
+ */
+size_t bitmap_arena_trim(struct bitmap_arena*);
+
+void bitmap_arena_destroy(struct bitmap_arena*);
@@ -1,5 +1,25 @@
 #!/bin/bash
 # Usage: CC=gcc ./build.sh | CC=clang ./build.sh etc, etc.
+#        CXX picks the C++ compiler used to check arena.hpp (default: c++), by
+#        compiling test.cpp, which instantiates all of it.
+#        CC=gcc ./build.sh bench [filter] builds and runs the benchmarks, saving
+#        their output to bench_output.txt. CFLAGS are added to that build, so
+#        that e.g. CFLAGS=-DARENA_PREFETCH benchmarks that configuration.
+#        The Makefile has the tests and the perf gate: make check.
 
-$CC -DNDEBUG -Wall -Wextra -Werror -pipe -pedantic -std=c99 -DFORTIFY_SOURCE=2 -O3 -march=native -c arena.c
-clang --analyze -DDEBUG -std=c99 -Wall -Wextra -Werror -pipe -pedantic arena.c
+SRCS="arena.c arena_mt.c bitmap_arena.c growable_arena.c size_classes.c arena_mmap.c persistent_arena.c arena_pool.c arena_profile.c region.c"
+
+if [ "$1" = bench ]; then
+    shift
+    $CC $CFLAGS -DNDEBUG -Wall -Wextra -Werror -pipe -pedantic -std=c99 -O3 -march=native -o bench bench.c $SRCS -lpthread -ldl -lm || exit 1
+    ./bench "$@" | tee bench_output.txt
+    exit ${PIPESTATUS[0]}
+fi
+
+for f in $SRCS; do
+    $CC -DNDEBUG -Wall -Wextra -Werror -pipe -pedantic -std=c99 -DFORTIFY_SOURCE=2 -O3 -march=native -c $f
+    clang --analyze -DDEBUG -std=c99 -Wall -Wextra -Werror -pipe -pedantic $f
+done
+
+${CXX:-c++} -std=c++17 -Wall -Wextra -Werror -pedantic -fsyntax-only test.cpp
+${CXX:-c++} -std=c++20 -Wall -Wextra -Werror -pedantic -fsyntax-only test.cpp
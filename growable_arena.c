@@ -0,0 +1,237 @@
+#include "growable_arena.h"
+#include "arena.h"
+#include "arena_config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * Each slab is a plain struct arena placed with arena_init_ at the start of
+ * its own block of memory, so a slab's block doubles as the address range
+ * its elements come from. The slab table is kept sorted by address, which
+ * lets growable_arena_free find an element's slab by binary search.
+ *
+ * `cur' is a slab known to have room. When it fills up, allocation looks for
+ * any other slab with room, and only grows the chain when there's none.
+ */
+
+struct slab {
+    struct arena* arena; // Also the start of the slab's block of memory.
+    char*  end;          // Points one past the end of the block.
+    size_t capacity;     // The number of elements in the slab.
+    size_t live;         // The number of those currently allocated.
+};
+
+struct growable_arena {
+    size_t size;                   // The size of each element.
+    struct growable_policy policy;
+    size_t next;                   // The number of elements in the next slab.
+    size_t empty;                  // The number of slabs with live == 0.
+
+    struct slab* slabs;  // Sorted by address.
+    size_t       nslabs; // The number of slabs in use.
+    size_t       cap;    // The number of slabs `slabs' has room for.
+    struct slab* cur;    // A slab with room, or NULL if there might be none.
+};
+
+static inline size_t min(size_t a, size_t b)
+{
+    return a <= b ? a : b;
+}
+
+// The fewest empty slabs kept around: never none, so that there's always a
+// slab to allocate from.
+static inline size_t retained(const struct growable_arena* g)
+{
+    return g->policy.retain == 0 ? 1 : g->policy.retain;
+}
+
+// Allocates a new slab and inserts it into the table. Returns NULL on failure.
+static struct slab* grow(struct growable_arena* g)
+{
+    if(g->nslabs == g->cap)
+    {
+        size_t cap = g->cap == 0 ? 4 : 2*g->cap;
+        struct slab* s = ALLOC(cap*sizeof(struct slab));
+        if(s == NULL) return NULL;
+
+        if(g->slabs != NULL)
+            memcpy(s, g->slabs, g->nslabs*sizeof(struct slab));
+
+        FREE(g->slabs);
+        g->slabs = s;
+        g->cap   = cap;
+    }
+
+    size_t count = g->next;
+
+    // arena_footprint wraps around rather than failing, so keep well clear
+    // of that. An element takes up at most size + 16 bytes.
+    if(count == 0 || g->size > SIZE_MAX/4 || count > SIZE_MAX/2 / (g->size + 16))
+        return NULL;
+
+    size_t len = arena_footprint(g->size, count);
+
+    void* mem = ALLOC(len);
+    if(mem == NULL) return NULL;
+
+    struct arena* a = arena_init_(g->size, count, mem, len);
+    if(a == NULL)
+    {
+        FREE(mem);
+        return NULL;
+    }
+
+    // Keep the table sorted by address.
+    size_t i = g->nslabs;
+    for(; i > 0 && (void*)g->slabs[i - 1].arena > mem; --i)
+        g->slabs[i] = g->slabs[i - 1];
+
+    g->slabs[i] = (struct slab) {
+        .arena    = a,
+        .end      = (char*)mem + len,
+        .capacity = count,
+        .live     = 0
+    };
+    ++g->nslabs;
+    ++g->empty;
+
+    if(g->policy.growth > 1)
+    {
+        g->next = count > SIZE_MAX/g->policy.growth ? SIZE_MAX : count*g->policy.growth;
+        if(g->policy.max != 0)
+            g->next = min(g->next, g->policy.max);
+    }
+
+    return &g->slabs[i];
+}
+
+// Unlinks and frees the slab at `s'.
+static void release(struct growable_arena* g, struct slab* s)
+{
+    FREE(s->arena);
+    memmove(s, s + 1, (size_t)(g->slabs + g->nslabs - (s + 1))*sizeof(struct slab));
+    --g->nslabs;
+    --g->empty;
+    g->cur = NULL;
+}
+
+// Releases empty slabs until no more than `keep' of them are left.
+static void shrink(struct growable_arena* g, size_t keep)
+{
+    for(size_t i = g->nslabs; i-- > 0 && g->empty > keep;)
+        if(g->slabs[i].live == 0)
+            release(g, &g->slabs[i]);
+}
+
+struct growable_arena* growable_arena_init(size_t size, struct growable_policy policy)
+{
+    if(policy.initial == 0)
+        return NULL;
+
+    struct growable_arena* g = ALLOC(sizeof(struct growable_arena));
+    if(g == NULL) return NULL;
+
+    *g = (struct growable_arena) {
+        .size   = size,
+        .policy = policy,
+        .next   = policy.max != 0 ? min(policy.initial, policy.max)
+                                  : policy.initial
+    };
+
+    if((g->cur = grow(g)) == NULL)
+    {
+        growable_arena_destroy(g);
+        return NULL;
+    }
+
+    return g;
+}
+
+void growable_arena_reset(struct growable_arena* g)
+{
+    for(size_t i = 0; i < g->nslabs; ++i)
+    {
+        arena_reset(g->slabs[i].arena);
+        g->slabs[i].live = 0;
+    }
+
+    g->empty = g->nslabs;
+    shrink(g, retained(g));
+    g->cur = g->nslabs != 0 ? &g->slabs[0] : NULL;
+}
+
+void* growable_arena_alloc(struct growable_arena* g)
+{
+    struct slab* s = g->cur;
+
+    if(s == NULL || s->live == s->capacity)
+    {
+        s = NULL;
+
+        for(size_t i = 0; i < g->nslabs && s == NULL; ++i)
+            if(g->slabs[i].live < g->slabs[i].capacity)
+                s = &g->slabs[i];
+
+        if(s == NULL && (s = grow(g)) == NULL)
+            return NULL;
+
+        g->cur = s;
+    }
+
+    if(s->live++ == 0)
+        --g->empty;
+
+    return arena_alloc(s->arena);
+}
+
+// Returns the slab `p' was allocated from.
+static struct slab* owner(struct growable_arena* g, void* p)
+{
+    size_t lo = 0, hi = g->nslabs;
+
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo)/2;
+
+        if((char*)p >= g->slabs[mid].end)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo == g->nslabs || (void*)g->slabs[lo].arena > p)
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    return &g->slabs[lo];
+}
+
+void growable_arena_free(struct growable_arena* g, void* p)
+{
+    if(p == NULL) return;
+
+    struct slab* s = owner(g, p);
+
+    arena_free(s->arena, p);
+
+    if(--s->live == 0)
+    {
+        // Start the empty slab over from its bump region, keeping its pages
+        // contiguous for the next burst.
+        arena_reset(s->arena);
+
+        if(++g->empty > retained(g))
+            release(g, s);
+    }
+}
+
+void growable_arena_destroy(struct growable_arena* g)
+{
+    for(size_t i = 0; i < g->nslabs; ++i)
+        FREE(g->slabs[i].arena);
+
+    FREE(g->slabs);
+    FREE(g);
+}
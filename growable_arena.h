@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * A growable arena is a chain of ordinary arenas ("slabs"). When every slab
+ * is full, a new one is linked in instead of returning NULL, so an arena no
+ * longer has to be sized for peak load up front.
+ *
+ * Slabs which become completely empty are handed back to the underlying
+ * allocator, unless fewer than `retain' empty slabs are left. Those are kept
+ * around to absorb the next burst without hitting malloc.
+ *
+ * growable_arena_free is O(log s), where s is the number of slabs. With
+ * geometric growth, s is logarithmic in the arena's peak size.
+ */
+struct growable_arena;
+
+struct growable_policy {
+    size_t initial; // The number of elements in the first slab.
+    size_t growth;  // Every new slab holds `growth' times as many elements as
+                    // the one before it. 1 means fixed-size slabs.
+    size_t max;     // Slabs never grow beyond `max' elements. 0 means no cap.
+    size_t retain;  // How many empty slabs are kept instead of released.
+                    // 0 is the same as 1: the last slab is never released.
+};
+
+/*
+ * growable_arena_init - Creates a growable arena of elements of size `size'.
+ *                       The first slab is allocated right away, so that the
+ *                       first allocation can't fail.
+ */
+struct growable_arena* growable_arena_init(size_t size, struct growable_policy);
+
+/*
+ * growable_arena_reset - Frees every element. Afterwards, at most `retain'
+ *                        slabs are left (but always at least one).
+ */
+void growable_arena_reset(struct growable_arena*);
+
+// Returns NULL only if a new slab was needed and couldn't be allocated.
+void* growable_arena_alloc(struct growable_arena*);
+void growable_arena_free(struct growable_arena*, void*);
+
+void growable_arena_destroy(struct growable_arena*);
@@ -0,0 +1,63 @@
+# The comparison behind `make perf'.
+#
+# Usage: awk -v threshold=15 -v row_threshold=100 -v slack=0.5 \
+#            -f perf_gate.awk baseline.txt runs.txt
+#
+# Both files hold bench output, any number of runs of it. A row is keyed by
+# its first five columns (benchmark, allocator, size, count and threads), and
+# each side's result is the best ns/op it has for the key. malloc, jemalloc
+# and tcmalloc rows are only there for comparison, so they're left out, and
+# so are rows only one side has.
+#
+# Single rows are noisy (on a busy VM, easily +50% from one run to the next),
+# so the gate is on the geometric mean of the slowdowns: it fails if that's
+# more than `threshold' percent. Rows more than `row_threshold' percent (plus
+# `slack' ns) slower fail it by themselves, to catch one path falling off a
+# cliff while the rest hide it.
+
+FNR == 1 { ++file }
+
+$7 != "ns/op" || $2 ~ /^(malloc|jemalloc|tcmalloc)$/ { next }
+
+{
+    key = $1 " " $2 " " $3 " " $4 " " $5
+    ns  = $6 + 0
+}
+
+file == 1 {
+    if(!(key in base) || ns < base[key]) base[key] = ns
+    next
+}
+
+{
+    if(!(key in best) || ns < best[key]) best[key] = ns
+}
+
+END {
+    for(key in best)
+    {
+        if(!(key in base) || base[key] <= 0) continue
+
+        ++compared
+        logs += log(best[key] / base[key])
+
+        if(best[key] > base[key] * (1 + row_threshold/100) + slack)
+        {
+            printf "SLOWER  %s: %.2f -> %.2f ns/op (%+.0f%%)\n", key, base[key], best[key],
+                   100 * (best[key] / base[key] - 1)
+            ++slower
+        }
+    }
+
+    if(compared == 0)
+    {
+        print "Nothing to compare against the baseline."
+        exit 1
+    }
+
+    mean = exp(logs / compared)
+    printf "%d results, %+.1f%% on average (geometric mean), %d more than %s%% slower.\n",
+           compared, 100 * (mean - 1), slower, row_threshold
+
+    exit slower > 0 || mean > 1 + threshold/100
+}
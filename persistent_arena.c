@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include "persistent_arena.h"
+#include "arena_config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * The same as arena.c: a bump region which is handed out first, and an
+ * intrusive free list of elements which have been freed. The difference is
+ * that every reference is an offset from the start of the buffer, plus one so
+ * that 0 can mean "none".
+ *
+ * The free list head also carries a generation count in its upper bits, like
+ * the head used by arena_alloc_atomic, so that the same layout works when
+ * several processes share one arena through the atomic variants.
+ *
+ * The file format:
+ *
+ *   [header, padded to a cache line][element 0][element 1]...
+ */
+
+// "ARENAPRS", in little endian.
+#define MAGIC   UINT64_C(0x5352504145524541)
+#define VERSION 1
+
+// The same pattern as arena.c's GUARD_BITS, but part of the file format, so
+// it must never change.
+#define FILE_GUARD UINT64_C(0xFF30000811100F1B)
+
+#define OFFSET_BITS 40
+#define OFFSET_MASK ((UINT64_C(1) << OFFSET_BITS) - 1)
+
+struct header {
+    uint64_t magic;    // Written last, so attachers know when it's ready.
+    uint64_t version;
+    uint64_t size;     // The size of each element.
+    uint64_t count;    // The number of elements in the buffer.
+    uint64_t bufstart; // The offset of the first never-allocated element.
+    uint64_t head;     // The free list: (generation << 40) | (offset + 1).
+};
+
+#define HEADER_SIZE ((sizeof(struct header) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+// Freed elements hold a node. Elements are at least this big.
+struct node {
+    uint64_t guard;
+    uint64_t next; // The next free element's offset plus one, or 0.
+};
+
+struct persistent_arena {
+    struct header* hdr;    // The start of the mapping.
+    char*          buffer; // hdr + HEADER_SIZE.
+    size_t         len;    // The length of the mapping.
+};
+
+static inline size_t max(size_t a, size_t b)
+{
+    return a <= b ? b : a;
+}
+
+// Elements are padded so that every node is 8-byte aligned.
+static inline size_t stride(size_t size)
+{
+    return (max(size, sizeof(struct node)) + 7) & ~(size_t)7;
+}
+
+static struct persistent_arena* map(int fd, size_t len)
+{
+    struct persistent_arena* a = ALLOC(sizeof(struct persistent_arena));
+    if(a == NULL) return NULL;
+
+    void* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        FREE(a);
+        return NULL;
+    }
+
+    a->hdr    = mem;
+    a->buffer = (char*)mem + HEADER_SIZE;
+    a->len    = len;
+
+    return a;
+}
+
+// Sizes `fd' for a fresh arena, maps it, and initializes it. Closes `fd'.
+static struct persistent_arena* create(int fd, size_t size, size_t count)
+{
+    size = stride(size);
+
+    size_t len = HEADER_SIZE + size*count;
+    struct persistent_arena* a = NULL;
+
+    if(size*count <= OFFSET_MASK && ftruncate(fd, (off_t)len) == 0)
+        a = map(fd, len);
+
+    close(fd);
+
+    if(a == NULL) return NULL;
+
+    *a->hdr = (struct header) {
+        .magic    = 0,
+        .version  = VERSION,
+        .size     = size,
+        .count    = count,
+        .bufstart = 0,
+        .head     = 0
+    };
+
+    // Publish the arena to anyone waiting in attach.
+    __atomic_store_n(&a->hdr->magic, MAGIC, __ATOMIC_RELEASE);
+
+    return a;
+}
+
+// Returns true if the free list link `link' is 0, or the start of one of the
+// elements in `h's buffer. The size and count must have been checked.
+static inline bool good_link(const struct header* h, uint64_t link)
+{
+    link &= OFFSET_MASK;
+    return link == 0 || (link - 1 < h->size*h->count && (link - 1) % h->size == 0);
+}
+
+static bool valid(struct persistent_arena* a)
+{
+    struct header* h = a->hdr;
+
+    // bufstart isn't checked: racing atomic allocations may have pushed it
+    // past the end, which just means the bump region is used up.
+    return __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == MAGIC
+        && h->version == VERSION
+        && h->size >= sizeof(struct node) && h->size % 8 == 0
+        && h->count <= (a->len - HEADER_SIZE) / h->size
+        && good_link(h, h->head);
+}
+
+// Maps an existing arena from `fd', and closes it. If `wait' is true, gives
+// whoever is creating it up to a second to finish.
+static struct persistent_arena* attach(int fd, bool wait)
+{
+    struct persistent_arena* a = NULL;
+    struct stat st;
+    int tries = wait ? 1000 : 1;
+    struct timespec ms = { 0, 1000000 };
+    int ok;
+
+    // First for the creator to size it...
+    while((ok = fstat(fd, &st)) == 0 && (size_t)st.st_size < HEADER_SIZE && --tries > 0)
+        nanosleep(&ms, NULL);
+
+    if(ok == 0 && (size_t)st.st_size >= HEADER_SIZE)
+        a = map(fd, (size_t)st.st_size);
+
+    close(fd);
+
+    if(a == NULL) return NULL;
+
+    // ...then for it to publish the header.
+    while(__atomic_load_n(&a->hdr->magic, __ATOMIC_ACQUIRE) != MAGIC && --tries > 0)
+        nanosleep(&ms, NULL);
+
+    if(!valid(a))
+    {
+        persistent_arena_close(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+struct persistent_arena* persistent_arena_create(const char* path, size_t size, size_t count)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return NULL;
+
+    return create(fd, size, count);
+}
+
+struct persistent_arena* persistent_arena_open(const char* path)
+{
+    int fd = open(path, O_RDWR);
+    if(fd < 0) return NULL;
+
+    return attach(fd, false);
+}
+
+struct persistent_arena* persistent_arena_shm(const char* name, size_t size, size_t count)
+{
+    // Exactly one process gets to create the segment...
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0)
+        return create(fd, size, count);
+
+    if(errno != EEXIST)
+        return NULL;
+
+    // ...and everyone else attaches to it.
+    if((fd = shm_open(name, O_RDWR, 0)) < 0)
+        return NULL;
+
+    struct persistent_arena* a = attach(fd, true);
+
+    if(a != NULL && (a->hdr->size != stride(size) || a->hdr->count != count))
+    {
+        persistent_arena_close(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+int persistent_arena_unlink_shm(const char* name)
+{
+    return shm_unlink(name);
+}
+
+int persistent_arena_sync(struct persistent_arena* a)
+{
+    return msync(a->hdr, a->len, MS_SYNC);
+}
+
+void persistent_arena_close(struct persistent_arena* a)
+{
+    persistent_arena_sync(a);
+    munmap(a->hdr, a->len);
+    FREE(a);
+}
+
+void persistent_arena_reset(struct persistent_arena* a)
+{
+    a->hdr->bufstart = 0;
+    a->hdr->head     = 0;
+}
+
+// Converts a free list link (offset plus one, or 0) to a node.
+static inline struct node* link_to_node(struct persistent_arena* a, uint64_t link)
+{
+    link &= OFFSET_MASK;
+    return link == 0 ? NULL : (struct node*)(a->buffer + link - 1);
+}
+
+static inline uint64_t node_to_link(struct persistent_arena* a, struct node* n)
+{
+    return n == NULL ? 0 : (uint64_t)((char*)n - a->buffer) + 1;
+}
+
+// Returns `link' tagged with the generation after `head's.
+static inline uint64_t next_head(uint64_t head, uint64_t link)
+{
+    return ((head >> OFFSET_BITS) + 1) << OFFSET_BITS | link;
+}
+
+// Returns true if `p' can be a live element of `a'. `bufstart' is passed in
+// since the atomic variants have to load it atomically.
+static inline bool allocated(struct persistent_arena* a, void* p, uint64_t bufstart)
+{
+    struct header* h = a->hdr;
+    uint64_t off = (uint64_t)((char*)p - a->buffer);
+
+    return (char*)p >= a->buffer && off < bufstart
+        && off < h->size*h->count && off % h->size == 0;
+}
+
+void* persistent_arena_alloc(struct persistent_arena* a)
+{
+    struct header* h = a->hdr;
+
+    if(h->bufstart < h->size*h->count)
+    {
+        void* p = a->buffer + h->bufstart;
+        h->bufstart += h->size;
+        return p;
+    }
+
+    // Oh no we're out of recyclable elements!
+    struct node* n = link_to_node(a, h->head);
+    if(n == NULL) return NULL;
+
+    // The next link comes from the file, so it has to point at an element
+    // before it's followed.
+    if(n->guard != FILE_GUARD || n->next > h->bufstart || !good_link(h, n->next))
+        error("Use of previously-freed pointer detected.");
+
+    h->head = next_head(h->head, n->next);
+    return n;
+}
+
+void persistent_arena_free(struct persistent_arena* a, void* p)
+{
+    struct header* h = a->hdr;
+    struct node*   n = p;
+
+    if(n == NULL) return;
+
+    if(!allocated(a, p, h->bufstart))
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    n->guard = FILE_GUARD;
+    n->next  = h->head & OFFSET_MASK;
+    h->head  = next_head(h->head, node_to_link(a, n));
+}
+
+/*
+ * The atomic variants work exactly like arena_alloc_atomic and
+ * arena_free_atomic: a fetch-add on bufstart, and a Treiber stack whose head
+ * carries a generation count against ABA. Since every process maps the same
+ * offsets, it doesn't matter which process pushed a node or where it has the
+ * arena mapped.
+ *
+ * With 24 bits of generation, ABA takes 16 million pushes and pops while one
+ * thread sits between loading the head and its CAS.
+ */
+void* persistent_arena_alloc_atomic(struct persistent_arena* a)
+{
+    struct header* h = a->hdr;
+    uint64_t limit = h->size*h->count;
+
+    if(__atomic_load_n(&h->bufstart, __ATOMIC_RELAXED) < limit)
+    {
+        uint64_t off = __atomic_fetch_add(&h->bufstart, h->size, __ATOMIC_RELAXED);
+        if(off < limit)
+            return a->buffer + off;
+    }
+
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+    struct node* n;
+
+    do {
+        if(!good_link(h, head))
+            error("Use of previously-freed pointer detected.");
+
+        if((n = link_to_node(a, head)) == NULL)
+            return NULL;
+    } while(!__atomic_compare_exchange_n(&h->head, &head,
+                next_head(head, __atomic_load_n(&n->next, __ATOMIC_RELAXED)),
+                true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    if(n->guard != FILE_GUARD)
+        error("Use of previously-freed pointer detected.");
+
+    return n;
+}
+
+void persistent_arena_free_atomic(struct persistent_arena* a, void* p)
+{
+    struct header* h = a->hdr;
+    struct node*   n = p;
+
+    if(n == NULL) return;
+
+    if(!allocated(a, p, __atomic_load_n(&h->bufstart, __ATOMIC_RELAXED)))
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    n->guard = FILE_GUARD;
+
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(&n->next, head & OFFSET_MASK, __ATOMIC_RELAXED);
+    } while(!__atomic_compare_exchange_n(&h->head, &head,
+                next_head(head, node_to_link(a, n)),
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint64_t persistent_arena_offset(struct persistent_arena* a, const void* p)
+{
+    return p == NULL ? 0 : (uint64_t)((const char*)p - (const char*)a->hdr);
+}
+
+void* persistent_arena_at(struct persistent_arena* a, uint64_t off)
+{
+    return off == 0 ? NULL : (char*)a->hdr + off;
+}
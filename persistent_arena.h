@@ -0,0 +1,80 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A persistent arena lives in a memory-mapped file. Everything inside it,
+ * from the header to the free list, is stored as offsets rather than
+ * pointers, so the file can be closed and mapped again later, at whatever
+ * address, and allocation picks up right where it left off. No
+ * deserialization needed.
+ *
+ * The same goes for the objects in it: pointers between them must be stored
+ * as offsets too. persistent_arena_offset and persistent_arena_at convert
+ * between the two.
+ *
+ * Nothing is made durable until persistent_arena_sync or
+ * persistent_arena_close returns, and a crash in the middle of an allocation
+ * or a free may leave the free list inconsistent.
+ */
+struct persistent_arena;
+
+/*
+ * persistent_arena_create - Creates (or truncates) the file at `path' and
+ *                           initializes a fresh arena of `count' elements of
+ *                           size `size' in it.
+ *
+ * persistent_arena_open - Maps an existing arena file. Returns NULL if it
+ *                         can't be opened or isn't a valid arena file.
+ *
+ * persistent_arena_close - Syncs and unmaps the arena.
+ */
+struct persistent_arena* persistent_arena_create(const char* path, size_t size, size_t count);
+struct persistent_arena* persistent_arena_open(const char* path);
+void persistent_arena_close(struct persistent_arena*);
+
+/*
+ * Sharing an arena between processes.
+ *
+ * persistent_arena_shm - Attaches to the POSIX shared memory segment `name',
+ *                        creating and initializing it first if it doesn't
+ *                        exist yet. When several processes race to create the
+ *                        same segment, exactly one of them initializes it and
+ *                        the rest wait (up to a second) for it to finish.
+ *                        Returns NULL if the segment exists with a different
+ *                        size or count. Detach with persistent_arena_close.
+ *
+ * persistent_arena_unlink_shm - Removes the segment's name. Processes which
+ *                               are attached stay attached.
+ *
+ * persistent_arena_alloc_atomic, persistent_arena_free_atomic - Lock-free
+ *     versions of persistent_arena_alloc and persistent_arena_free, safe to
+ *     call from any thread of any attached process. An element may be freed
+ *     by a different process than the one that allocated it. As with
+ *     arena_alloc_atomic, don't mix them with the plain versions.
+ *
+ * Shared arenas also work on files: persistent_arena_open the same file from
+ * several processes and use the atomic variants.
+ */
+struct persistent_arena* persistent_arena_shm(const char* name, size_t size, size_t count);
+int persistent_arena_unlink_shm(const char* name);
+
+void* persistent_arena_alloc_atomic(struct persistent_arena*);
+void persistent_arena_free_atomic(struct persistent_arena*, void*);
+
+// Flushes the arena to its file. Returns 0 on success, -1 on error.
+int persistent_arena_sync(struct persistent_arena*);
+
+void persistent_arena_reset(struct persistent_arena*);
+
+void* persistent_arena_alloc(struct persistent_arena*);
+void persistent_arena_free(struct persistent_arena*, void*);
+
+/*
+ * persistent_arena_offset - Converts a pointer into the arena to an offset
+ *                           which stays valid across mappings. NULL maps to 0.
+ *
+ * persistent_arena_at - The reverse. 0 maps to NULL.
+ */
+uint64_t persistent_arena_offset(struct persistent_arena*, const void* p);
+void* persistent_arena_at(struct persistent_arena*, uint64_t off);
@@ -0,0 +1,93 @@
+#include "region.h"
+#include "arena_config.h"
+
+#include <stdint.h>
+
+/*
+ * HOW IT WORKS:
+ *
+ * Like an arena, the header sits right before the buffer, in one block of
+ * memory. `top' is the first byte never handed out since the last reset:
+ * allocating rounds it up to the alignment asked for and moves it past the
+ * allocation, and resetting moves it back to the start of the buffer.
+ */
+
+struct region {
+    char* top;    // The first byte not handed out.
+    char* buffer; // The start of the buffer.
+    char* end;    // One past the end of the buffer.
+
+    struct arena_backing backing; // Where the region's memory came from. All
+                                  // NULL if it came from region_init_.
+    size_t backed;                // How much was asked of `backing'.
+};
+
+struct region* region_init(size_t capacity)
+{
+    return region_init_with(capacity, &arena_heap_backing);
+}
+
+struct region* region_init_with(size_t capacity, const struct arena_backing* backing)
+{
+    size_t len = sizeof(struct region) + capacity;
+
+    if(len < capacity) return NULL;
+
+    void* mem = backing->alloc(backing->ctx, len);
+    if(mem == NULL) return NULL;
+
+    struct region* r = region_init_(mem, len);
+
+    r->backing = *backing;
+    r->backed  = len;
+
+    return r;
+}
+
+struct region* region_init_(void* mem, size_t len)
+{
+    if(len < sizeof(struct region))
+        return NULL;
+
+    struct region* r = mem;
+    char* buf = (char*)(r + 1);
+
+    *r = (struct region) {
+        .top    = buf,
+        .buffer = buf,
+        .end    = (char*)mem + len
+    };
+
+    return r;
+}
+
+void* region_alloc(struct region* r, size_t n, size_t align)
+{
+    if(align == 0 || (align & (align - 1)) != 0)
+        return NULL;
+
+    uintptr_t p = ((uintptr_t)r->top + align - 1) & ~(uintptr_t)(align - 1);
+
+    // Rounding up can go past the end, or wrap around.
+    if(p < (uintptr_t)r->top || p > (uintptr_t)r->end || n > (uintptr_t)r->end - p)
+        return NULL;
+
+    r->top = (char*)p + n;
+    return (void*)p;
+}
+
+void region_reset(struct region* r)
+{
+    r->top = r->buffer;
+}
+
+size_t region_used(const struct region* r)
+{
+    return (size_t)(r->top - r->buffer);
+}
+
+void region_destroy(struct region* r)
+{
+    if(r->backing.free != NULL)
+        r->backing.free(r->backing.ctx, r, r->backed);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A region is the variable-size counterpart of an arena: one buffer, bumped
+ * through like an arena's untouched elements, but by however many bytes each
+ * allocation asks for. There's no free; everything goes at once, in O(1),
+ * when the region is reset.
+ *
+ * Attached to an arena (see arena_attach_region), a region is reset along
+ * with it, so that e.g. a request's fixed-size objects and its strings and
+ * arrays all go away with one arena_reset.
+ */
+struct region;
+
+/*
+ * region_init - Creates a region of `capacity' bytes, with memory from the
+ *               heap.
+ *
+ * region_init_with - The same, with memory from `backing' (see arena.h).
+ *                    With arena_backing_of, a region takes up one element of
+ *                    a parent arena.
+ *
+ * region_init_ - Places a region in the `len' bytes at `mem', header and all.
+ *                region_destroy leaves `mem' alone. Returns NULL if `len'
+ *                doesn't even hold the header.
+ */
+struct region* region_init(size_t capacity);
+struct region* region_init_with(size_t capacity, const struct arena_backing* backing);
+struct region* region_init_(void* mem, size_t len);
+
+/*
+ * region_alloc - Returns `n' bytes aligned to `align', which must be a power
+ *                of two, or NULL if the region doesn't have that many left.
+ *                O(1).
+ *
+ * region_reset - Frees everything allocated from the region. O(1).
+ *
+ * region_used - The number of bytes allocated since the last reset, padding
+ *               included.
+ */
+void* region_alloc(struct region*, size_t n, size_t align);
+void region_reset(struct region*);
+size_t region_used(const struct region*);
+
+void region_destroy(struct region*);
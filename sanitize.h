@@ -0,0 +1,64 @@
+#pragma once
+
+/*
+ * Sanitizer annotations shared by the allocators which hold on to free
+ * memory. Not part of the public interface.
+ */
+
+#if defined(__SANITIZE_ADDRESS__)
+    #define ARENA_ASAN
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define ARENA_ASAN
+    #endif
+#endif
+
+/*
+ * What ASan or Valgrind is told about memory:
+ *
+ * HIDE - Nothing may touch it: it's free memory the allocator holds on to.
+ * PEEK - The allocator itself is about to touch hidden memory it wrote.
+ * REVEAL - It's been handed out, contents undefined.
+ * IS_HIDDEN - Whether `p' is hidden. Always false under Valgrind, which
+ *             reports bad frees itself.
+ *
+ * POOL_* describe an arena to Valgrind as a mempool, and SANITIZED is
+ * defined whenever any of this does something.
+ */
+#if defined(ARENA_ASAN)
+    #include <sanitizer/asan_interface.h>
+
+    #define HIDE(p, len)   ASAN_POISON_MEMORY_REGION((p), (len))
+    #define PEEK(p, len)   ASAN_UNPOISON_MEMORY_REGION((p), (len))
+    #define REVEAL(p, len) ASAN_UNPOISON_MEMORY_REGION((p), (len))
+    #define IS_HIDDEN(p)   __asan_address_is_poisoned(p)
+    #define POOL_CREATE(a)
+    #define POOL_ALLOC(a, p)
+    #define POOL_FREE(a, p)
+    #define POOL_KEEP(a, len)
+    #define POOL_DESTROY(a)
+    #define SANITIZED
+#elif defined(ARENA_VALGRIND)
+    #include <valgrind/memcheck.h>
+
+    #define HIDE(p, len)      VALGRIND_MAKE_MEM_NOACCESS((p), (len))
+    #define PEEK(p, len)      VALGRIND_MAKE_MEM_DEFINED((p), (len))
+    #define REVEAL(p, len)    VALGRIND_MAKE_MEM_UNDEFINED((p), (len))
+    #define IS_HIDDEN(p)      false // Valgrind reports bad frees itself.
+    #define POOL_CREATE(a)    VALGRIND_CREATE_MEMPOOL((a), 0, 0)
+    #define POOL_ALLOC(a, p)  VALGRIND_MEMPOOL_ALLOC((a), (p), (a)->size)
+    #define POOL_FREE(a, p)   VALGRIND_MEMPOOL_FREE((a), (p))
+    #define POOL_KEEP(a, len) VALGRIND_MEMPOOL_TRIM((a), (a)->buffer, (len)) // Frees chunks past len.
+    #define POOL_DESTROY(a)   VALGRIND_DESTROY_MEMPOOL(a)
+    #define SANITIZED
+#else
+    #define HIDE(p, len)   ((void)0)
+    #define PEEK(p, len)   ((void)0)
+    #define REVEAL(p, len) ((void)0)
+    #define IS_HIDDEN(p)   false
+    #define POOL_CREATE(a)
+    #define POOL_ALLOC(a, p)
+    #define POOL_FREE(a, p)
+    #define POOL_KEEP(a, len)
+    #define POOL_DESTROY(a)
+#endif
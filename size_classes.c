@@ -0,0 +1,136 @@
+#include "size_classes.h"
+#include "arena.h"
+#include "arena_config.h"
+
+#include <stdint.h>
+
+// What malloc guarantees on 64-bit targets: alignof(max_align_t) in C11.
+#define CLASS_ALIGN 16
+
+const size_t size_classes_default[12] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+
+struct size_classes {
+    size_t  nclasses; // The number of size classes.
+    size_t  region;   // The number of bytes given to each class's arena.
+    char*   base;     // The first class's region. The rest follow it.
+    size_t  max;      // The size of the biggest class.
+    size_t* sizes;    // The size of each class.
+    uint8_t* lookup;  // Maps ceil(size/SIZE_CLASS_QUANTUM) to a class.
+
+    struct arena* arenas[]; // One per class, at base + i*region.
+};
+
+static inline size_t quanta(size_t size)
+{
+    return (size + SIZE_CLASS_QUANTUM - 1) / SIZE_CLASS_QUANTUM;
+}
+
+struct size_classes* size_classes_init(const size_t* classes, size_t n, size_t bytes)
+{
+    if(classes == NULL)
+    {
+        classes = size_classes_default;
+        n = sizeof(size_classes_default)/sizeof(size_classes_default[0]);
+    }
+
+    if(n == 0 || n > UINT8_MAX)
+        return NULL;
+
+    for(size_t i = 0; i < n; ++i)
+        if(classes[i] == 0 || (i > 0 && classes[i] <= classes[i - 1]))
+            return NULL;
+
+    size_t max   = classes[n - 1];
+    size_t tbl   = quanta(max) + 1;
+    size_t hdr   = sizeof(struct size_classes) + n*sizeof(struct arena*);
+    size_t sizes = n*sizeof(size_t);
+
+    // Regions are placed after the header and tables, so keep them aligned.
+    size_t pre = (hdr + sizes + tbl + SIZE_CLASS_QUANTUM - 1)
+               / SIZE_CLASS_QUANTUM * SIZE_CLASS_QUANTUM;
+
+    bytes = bytes / SIZE_CLASS_QUANTUM * SIZE_CLASS_QUANTUM;
+
+    struct size_classes* s = ALLOC(pre + n*bytes);
+    if(s == NULL) return NULL;
+
+    s->nclasses = n;
+    s->region   = bytes;
+    s->base     = (char*)s + pre;
+    s->max      = max;
+    s->sizes    = (size_t*)((char*)s + hdr);
+    s->lookup   = (uint8_t*)(s->sizes + n);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t c = classes[i];
+        size_t stride = arena_footprint_aligned(c, 1, CLASS_ALIGN, false)
+                      - arena_footprint_aligned(c, 0, CLASS_ALIGN, false);
+        size_t header = arena_footprint_aligned(c, 0, CLASS_ALIGN, false);
+        size_t count  = bytes > header ? (bytes - header)/stride : 0;
+
+        s->sizes[i]  = c;
+        s->arenas[i] = arena_init_aligned_(c, count, CLASS_ALIGN, false, s->base + i*bytes, bytes);
+
+        if(s->arenas[i] == NULL)
+        {
+            FREE(s);
+            return NULL;
+        }
+    }
+
+    // Every size in (q - 1, q] quanta goes to the smallest class holding q.
+    for(size_t q = 0, i = 0; q < tbl; ++q)
+    {
+        while(classes[i] < q*SIZE_CLASS_QUANTUM && i + 1 < n)
+            ++i;
+
+        s->lookup[q] = (uint8_t)i;
+    }
+
+    return s;
+}
+
+void size_classes_reset(struct size_classes* s)
+{
+    for(size_t i = 0; i < s->nclasses; ++i)
+        arena_reset(s->arenas[i]);
+}
+
+void* size_classes_alloc(struct size_classes* s, size_t size)
+{
+    if(size > s->max)
+        return NULL;
+
+    return arena_alloc(s->arenas[s->lookup[quanta(size)]]);
+}
+
+// Returns the index of the class `p' was allocated from.
+static inline size_t class_of(struct size_classes* s, void* p)
+{
+    size_t i = (size_t)((char*)p - s->base) / s->region;
+
+    if((char*)p < s->base || i >= s->nclasses)
+        error("Trying to free a pointer which was not allocated in this arena.");
+
+    return i;
+}
+
+void size_classes_free(struct size_classes* s, void* p)
+{
+    if(p == NULL) return;
+
+    arena_free(s->arenas[class_of(s, p)], p);
+}
+
+size_t size_classes_size(struct size_classes* s, void* p)
+{
+    return s->sizes[class_of(s, p)];
+}
+
+void size_classes_destroy(struct size_classes* s)
+{
+    FREE(s);
+}
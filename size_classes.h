@@ -0,0 +1,46 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * A general purpose small object allocator, made of one arena per size class.
+ *
+ * Each class's arena gets an equally sized, contiguous region of one big
+ * block. That means both directions are O(1) without any per-object header:
+ * a request is routed to its class through a lookup table indexed by size
+ * (in units of SIZE_CLASS_QUANTUM bytes), and a pointer is routed back to its
+ * class by dividing its offset into the block by the region size.
+ *
+ * Every object is aligned to 16 bytes, as malloc's are, whatever the classes.
+ */
+
+// The granularity of the size lookup table. Class sizes which aren't a
+// multiple of it still work, but waste a little room.
+#define SIZE_CLASS_QUANTUM 16
+
+struct size_classes;
+
+// 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768 and 1024 bytes.
+extern const size_t size_classes_default[12];
+
+/*
+ * size_classes_init - Creates an allocator with the `n' size classes in
+ *                     `classes', which must be strictly increasing. Each class
+ *                     gets `bytes' bytes of memory, header included. If
+ *                     `classes' is NULL, size_classes_default is used instead.
+ *
+ * size_classes_alloc - Returns an object of at least `size' bytes, or NULL if
+ *                      `size' is bigger than the biggest class or its class
+ *                      has run out of room. Allocation doesn't spill over into
+ *                      bigger classes.
+ *
+ * size_classes_size - The size of the class `p' was allocated from.
+ */
+struct size_classes* size_classes_init(const size_t* classes, size_t n, size_t bytes);
+
+void size_classes_reset(struct size_classes*);
+
+void* size_classes_alloc(struct size_classes*, size_t size);
+void size_classes_free(struct size_classes*, void* p);
+size_t size_classes_size(struct size_classes*, void* p);
+
+void size_classes_destroy(struct size_classes*);
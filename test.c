@@ -0,0 +1,1498 @@
+#define _DEFAULT_SOURCE // For tmpfile's fileno.
+#define ARENA_INLINE    // So that the inline fast paths get tested too.
+#include "arena.h"
+#include "arena_config.h"
+#include "arena_mmap.h"
+#include "arena_mt.h"
+#include "arena_pool.h"
+#include "bitmap_arena.h"
+#include "growable_arena.h"
+#include "persistent_arena.h"
+#include "region.h"
+#include "size_classes.h"
+
+#ifdef ARENA_PROFILE
+    #include "arena_profile.h"
+#endif
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The tests behind `make test' and `make tsan' (see the Makefile).
+ *
+ * ./test model [steps] [seed] - Drives every allocator through random
+ *     operations, checking each result against a reference model of what is
+ *     live. Live elements hold a tag at both ends, so an allocator handing
+ *     out an element twice or scribbling over a live one shows up too. A
+ *     seed of 0 picks one from the clock; it's printed either way, so that
+ *     a failing run can be replayed. Then checks the persistent and
+ *     mmap-backed arenas, dirty snapshots and, built with ARENA_PROFILE, the
+ *     profiler's stacks and dumps.
+ *
+ * ./test threads [steps] - Hammers the thread-safe parts (the atomic
+ *     variants, arena_free_remote, pools and magazines) from TEST_THREADS
+ *     threads at once. Meant to be run under TSan, which catches the races
+ *     the tags can't.
+ */
+
+#define TEST_THREADS 4
+
+static uint64_t seed, rng;
+static uint64_t step;
+
+#define check(cond) \
+    ((cond) ? (void)0 : fail(#cond, __FILE__, __LINE__))
+
+static void fail(const char* what, const char* file, int line)
+{
+    fprintf(stderr, "%s:%d: check failed: %s (seed %" PRIu64 ", step %" PRIu64 ")\n",
+            file, line, what, seed, step);
+    abort();
+}
+
+// xorshift64*.
+static uint64_t next(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * UINT64_C(2685821657736338717);
+}
+
+// A uniform number in [0, n).
+static size_t below(size_t n)
+{
+    return (size_t)(next() % n);
+}
+
+/*
+ * The reference model: which elements are live, and the tag each one holds.
+ * Pointers are kept in an open addressing table for lookups, and in an array
+ * for picking one at random.
+ */
+struct model {
+    size_t    n, cap;
+    void**    live;  // In no particular order.
+    uint64_t* tags;  // tags[k] belongs to live[k].
+    size_t*   table; // 1 + k for live[k], 0 for an empty slot.
+    size_t    mask;
+    uint64_t  serial;
+};
+
+static size_t hash(const void* p)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(x ^ (x >> 29));
+}
+
+static void model_init(struct model* m, size_t cap)
+{
+    size_t slots = 16;
+    while(slots < 2*cap) slots *= 2;
+
+    *m = (struct model) {
+        .cap   = cap,
+        .live  = malloc(cap*sizeof(void*)),
+        .tags  = malloc(cap*sizeof(uint64_t)),
+        .table = calloc(slots, sizeof(size_t)),
+        .mask  = slots - 1
+    };
+
+    check(m->live != NULL && m->tags != NULL && m->table != NULL);
+}
+
+static void model_destroy(struct model* m)
+{
+    free(m->live);
+    free(m->tags);
+    free(m->table);
+}
+
+// The table slot holding `p', or the empty one where it would go.
+static size_t slot_of(const struct model* m, const void* p)
+{
+    size_t s = hash(p) & m->mask;
+
+    while(m->table[s] != 0 && m->live[m->table[s] - 1] != p)
+        s = (s + 1) & m->mask;
+
+    return s;
+}
+
+static bool is_live(const struct model* m, const void* p)
+{
+    return m->table[slot_of(m, p)] != 0;
+}
+
+static void put_tag(void* p, size_t size, uint64_t tag)
+{
+    memcpy(p, &tag, sizeof(tag));
+    memcpy((char*)p + size - sizeof(tag), &tag, sizeof(tag));
+}
+
+static bool has_tag(const void* p, size_t size, uint64_t tag)
+{
+    uint64_t a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, (const char*)p + size - sizeof(b), sizeof(b));
+    return a == tag && b == tag;
+}
+
+// Records `p' as live, and tags it.
+static void model_add(struct model* m, void* p, size_t size)
+{
+    check(p != NULL);
+    check(!is_live(m, p)); // Handed out twice.
+    check(m->n < m->cap);
+
+    uint64_t tag = ++m->serial * UINT64_C(0x9E3779B97F4A7C15) | 1;
+
+    m->live[m->n] = p;
+    m->tags[m->n] = tag;
+    m->table[slot_of(m, p)] = ++m->n;
+    put_tag(p, size, tag);
+}
+
+// Forgets the k'th live element, and returns it.
+static void* model_forget(struct model* m, size_t k)
+{
+    void* p = m->live[k];
+
+    // Delete from the table, shifting back whatever probed past it.
+    size_t s = slot_of(m, p);
+    m->table[s] = 0;
+
+    for(size_t t = (s + 1) & m->mask; m->table[t] != 0; t = (t + 1) & m->mask)
+    {
+        size_t home = hash(m->live[m->table[t] - 1]) & m->mask;
+
+        // Moves back unless its home lies cyclically in (s, t].
+        if(((t - home) & m->mask) >= ((t - s) & m->mask))
+        {
+            m->table[s] = m->table[t];
+            m->table[t] = 0;
+            s = t;
+        }
+    }
+
+    // Fill the hole in `live' with the last one.
+    if(--m->n != k)
+    {
+        m->live[k] = m->live[m->n];
+        m->tags[k] = m->tags[m->n];
+        m->table[slot_of(m, m->live[k])] = k + 1;
+    }
+
+    return p;
+}
+
+// Checks the k'th live element's tag, then forgets it.
+static void* model_take(struct model* m, size_t k, size_t size)
+{
+    check(has_tag(m->live[k], size, m->tags[k]));
+    return model_forget(m, k);
+}
+
+static void model_clear(struct model* m)
+{
+    m->n = 0;
+    memset(m->table, 0, (m->mask + 1)*sizeof(size_t));
+}
+
+static void model_verify(const struct model* m, size_t size)
+{
+    for(size_t k = 0; k < m->n; ++k)
+        check(has_tag(m->live[k], size, m->tags[k]));
+}
+
+/*
+ * struct arena, with everything that goes with it.
+ */
+
+struct arena_case {
+    struct arena* a;
+    struct model  m;
+    size_t        size, count, align; // As asked for; a->size may be bigger.
+    bool          placed;             // Made with arena_init_aligned_.
+    void*         mem;
+
+    bool   marked;
+    struct arena_mark mark;
+    size_t mark_top; // The index of the first untouched element at the mark.
+
+    char* region_start; // Where the attached region's buffer starts, once known.
+    char* region_top;   // Past the last region allocation since its reset.
+
+    void* served; // What the last waiter got.
+};
+
+static size_t index_of(struct arena* a, const void* p)
+{
+    check((const char*)p >= (const char*)a->buffer
+       && (const char*)p < (const char*)a->bufend);
+    check(((const char*)p - (const char*)a->buffer) % a->size == 0);
+
+    return (size_t)((const char*)p - (const char*)a->buffer) / a->size;
+}
+
+static size_t top_of(struct arena* a)
+{
+    return a->bufstart < a->bufend ? index_of(a, a->bufstart) : a->count;
+}
+
+static struct arena* make_arena(struct arena_case* c)
+{
+    if(c->placed)
+    {
+        size_t len = arena_footprint_aligned(c->size, c->count, c->align, true);
+        c->mem = malloc(len);
+        check(c->mem != NULL);
+        return arena_init_aligned_(c->size, c->count, c->align, true, c->mem, len);
+    }
+
+    c->mem = NULL;
+    return c->align == 1 ? arena_init(c->size, c->count)
+                         : arena_init_aligned(c->size, c->count, c->align, false);
+}
+
+static void attach_region(struct arena_case* c)
+{
+    struct region* r = region_init(1 + below(4096));
+    check(r != NULL);
+
+    arena_attach_region(c->a, r);
+    c->region_start = c->region_top = NULL;
+}
+
+static void alloc_one(struct arena_case* c)
+{
+    struct arena* a = c->a;
+    void* p = arena_alloc(a);
+
+    if(p == NULL)
+    {
+        check(c->m.n == c->count);
+        return;
+    }
+
+    index_of(a, p);
+    model_add(&c->m, p, a->size);
+}
+
+static void free_one(struct arena_case* c)
+{
+    if(c->m.n == 0) return;
+
+    void* p = model_take(&c->m, below(c->m.n), c->a->size);
+
+    if(below(8) == 0)
+        arena_free_remote(c->a, p);
+    else
+        arena_free(c->a, p);
+}
+
+static void alloc_many(struct arena_case* c)
+{
+    void*  out[32];
+    size_t want = 1 + below(32);
+    size_t got  = arena_alloc_n(c->a, out, want);
+
+    check(got == want || c->m.n + got == c->count);
+
+    for(size_t i = 0; i < got; ++i)
+    {
+        index_of(c->a, out[i]);
+        model_add(&c->m, out[i], c->a->size);
+    }
+}
+
+static void free_many(struct arena_case* c)
+{
+    void*  p[33];
+    size_t n = below(33);
+
+    for(size_t i = 0; i < n; ++i)
+        p[i] = c->m.n != 0 && below(8) != 0 ? model_take(&c->m, below(c->m.n), c->a->size) : NULL;
+
+    arena_free_n(c->a, p, n);
+}
+
+static void reset(struct arena_case* c)
+{
+    arena_reset(c->a);
+    model_clear(&c->m);
+    c->marked     = false;
+    c->region_top = NULL;
+
+    // Everything comes from the bump region again, from the bottom up.
+    if(c->count > 0)
+    {
+        void* p = arena_alloc(c->a);
+        check(p == c->a->buffer);
+        model_add(&c->m, p, c->a->size);
+    }
+}
+
+static void take_mark(struct arena_case* c)
+{
+    c->mark     = arena_mark(c->a);
+    c->mark_top = top_of(c->a);
+    c->marked   = true;
+}
+
+static void rollback(struct arena_case* c)
+{
+    if(!c->marked) return;
+
+    // Marks taken after this one are gone too, and there are none.
+    c->marked = false;
+
+    if(!arena_rollback_to(c->a, c->mark))
+        return;
+
+    check(top_of(c->a) == c->mark_top);
+
+    // Everything allocated since the mark came from above it, and is gone.
+    for(size_t k = c->m.n; k-- > 0;)
+        if(index_of(c->a, c->m.live[k]) >= c->mark_top)
+            model_forget(&c->m, k);
+}
+
+static void reorder(struct arena_case* c)
+{
+    arena_reorder(c->a);
+    c->marked = false;
+
+    // Without trimmed elements about, the lowest free element comes first.
+    if(c->a->released != NULL || c->m.n == c->count)
+        return;
+
+    size_t lowest = 0;
+    while(lowest < c->count && is_live(&c->m, (char*)c->a->buffer + lowest*c->a->size))
+        ++lowest;
+
+    void* p = arena_alloc(c->a);
+    check(p != NULL && index_of(c->a, p) == lowest);
+    model_add(&c->m, p, c->a->size);
+}
+
+static void trim(struct arena_case* c)
+{
+    arena_trim(c->a);
+    c->marked = false;
+    model_verify(&c->m, c->a->size);
+}
+
+struct visit {
+    struct arena_case* c;
+    size_t seen;
+};
+
+static void visit_live(void* obj, void* ctx)
+{
+    struct visit* v = ctx;
+
+    check(is_live(&v->c->m, obj));
+    ++v->seen;
+}
+
+static void verify(struct arena_case* c)
+{
+    struct visit v = { .c = c };
+
+    check(arena_foreach_live(c->a, visit_live, &v));
+    check(v.seen == c->m.n);
+    model_verify(&c->m, c->a->size);
+
+#ifdef ARENA_STATS
+    // arena_foreach_live drained the remote frees, so the counts agree.
+    struct arena_stats s;
+    arena_stats(c->a, &s);
+    check(s.live == c->m.n);
+    check(s.peak >= s.live);
+#endif
+}
+
+// Restores `a' from all but the last byte of the snapshot in `f', which cuts
+// off the element data. That empties the arena, but its region has
+// to stay as it was.
+static void restore_truncated(struct arena* a, FILE* f)
+{
+    check(fseek(f, 0, SEEK_END) == 0);
+    long len = ftell(f);
+    check(len > 0);
+    rewind(f);
+
+    char* buf = malloc((size_t)len);
+    check(buf != NULL && fread(buf, 1, (size_t)len, f) == (size_t)len);
+
+    FILE* g = tmpfile();
+    check(g != NULL && fwrite(buf, 1, (size_t)len - 1, g) == (size_t)len - 1);
+    check(fflush(g) == 0 && lseek(fileno(g), 0, SEEK_SET) == 0);
+
+    struct region* r = region_init(64);
+    check(r != NULL);
+    arena_attach_region(a, r);
+
+    char* bytes = arena_alloc_bytes(a, 16, 1);
+    check(bytes != NULL);
+    memset(bytes, 0x5A, 16);
+
+    check(!arena_restore(a, fileno(g)));
+    check(region_used(r) == 16);
+
+    for(size_t i = 0; i < 16; ++i)
+        check(bytes[i] == 0x5A);
+
+    void* p = arena_alloc(a);
+    check(p == a->buffer);
+    arena_free(a, p);
+
+    fclose(g);
+    free(buf);
+
+    // rewind alone may just move within stdio's buffer.
+    rewind(f);
+    check(lseek(fileno(f), 0, SEEK_SET) == 0);
+}
+
+// Takes a snapshot, restores it into a fresh arena, and carries on with that.
+static void snapshot(struct arena_case* c)
+{
+    FILE* f = tmpfile();
+    check(f != NULL);
+    check(arena_snapshot(c->a, fileno(f)));
+    rewind(f);
+
+    struct arena_case d = *c;
+    d.a = make_arena(&d);
+    check(d.a != NULL && d.a->size == c->a->size);
+
+    // Whatever the arena held before is overwritten.
+    for(size_t i = below(d.count + 1); i > 0; --i)
+        check(arena_alloc(d.a) != NULL);
+
+    // So is a snapshot cut short, as long as it has elements to cut.
+    if(top_of(c->a) > 0 && below(2) == 0)
+        restore_truncated(d.a, f);
+
+    check(arena_restore(d.a, fileno(f)));
+    fclose(f);
+
+    // Live elements stay where they were, tags and all.
+    for(size_t k = 0; k < c->m.n; ++k)
+        d.m.live[k] = (char*)d.a->buffer + index_of(c->a, c->m.live[k])*c->a->size;
+
+    memset(d.m.table, 0, (d.m.mask + 1)*sizeof(size_t));
+
+    for(size_t k = 0; k < d.m.n; ++k)
+        d.m.table[slot_of(&d.m, d.m.live[k])] = k + 1;
+
+    check(top_of(d.a) == top_of(c->a));
+    arena_destroy(c->a);
+    free(c->mem);
+
+    *c = d;
+    c->marked = false;
+    attach_region(c);
+    verify(c);
+}
+
+static void ready(void* ctx, void* p)
+{
+    *(void**)ctx = p;
+}
+
+// Parks a waiter on a full arena, then frees an element for it.
+static void wait_for_one(struct arena_case* c)
+{
+    if(c->m.n != c->count || c->count == 0) return;
+
+    struct arena_waiter w = { .ready = ready, .ctx = &c->served };
+
+    c->served = NULL;
+    check(arena_alloc_async(c->a, &w) == NULL);
+
+    if(below(4) == 0)
+    {
+        check(arena_cancel_async(c->a, &w));
+        check(!arena_cancel_async(c->a, &w));
+        return;
+    }
+
+    void* p = model_take(&c->m, below(c->m.n), c->a->size);
+    arena_free(c->a, p);
+
+    check(c->served == p);
+    model_add(&c->m, p, c->a->size);
+}
+
+static void region_bytes(struct arena_case* c)
+{
+    size_t n     = below(200);
+    size_t align = (size_t)1 << below(8);
+    char*  p     = arena_alloc_bytes(c->a, n, align);
+
+    if(p == NULL) return;
+
+    check((uintptr_t)p % align == 0);
+
+    // Allocations since the last reset follow each other, and the first one
+    // starts at the bottom.
+    if(c->region_top != NULL)
+        check(p >= c->region_top);
+    else if(c->region_start != NULL)
+        check(p >= c->region_start && (size_t)(p - c->region_start) < align);
+    else if(align == 1)
+        c->region_start = p;
+
+    memset(p, 0xA5, n);
+    c->region_top = p + n;
+}
+
+static void test_arena(uint64_t steps)
+{
+    static const size_t sizes[]  = { 16, 24, 40, 64, 104, 256 }; // Nodes need 8-byte alignment.
+    static const size_t aligns[] = { 1, 1, 8, 64 };
+
+    while(steps > 0)
+    {
+        struct arena_case c = {
+            .size   = sizes[below(sizeof(sizes)/sizeof(sizes[0]))],
+            .count  = below(8) == 0 ? below(4) : 1 + below(3000),
+            .align  = aligns[below(sizeof(aligns)/sizeof(aligns[0]))],
+            .placed = below(2) == 0
+        };
+
+        c.a = make_arena(&c);
+        check(c.a != NULL);
+        model_init(&c.m, c.count + 1);
+        attach_region(&c);
+
+        if(below(4) == 0)
+            arena_set_reorder(c.a, 1 + below(64));
+
+        uint64_t round = 1000 + below(20000);
+        if(round > steps) round = steps;
+
+        for(uint64_t s = 0; s < round; ++s, ++step)
+        {
+            size_t r = below(1000);
+
+            if(r < 400)      alloc_one(&c);
+            else if(r < 750) free_one(&c);
+            else if(r < 800) alloc_many(&c);
+            else if(r < 850) free_many(&c);
+            else if(r < 853) reset(&c);
+            else if(r < 870) take_mark(&c);
+            else if(r < 890) rollback(&c);
+            else if(r < 895) reorder(&c);
+            else if(r < 900) trim(&c);
+            else if(r < 910) verify(&c);
+            else if(r < 912) snapshot(&c);
+            else if(r < 940) wait_for_one(&c);
+            else             region_bytes(&c);
+        }
+
+        verify(&c);
+        arena_destroy(c.a);
+        free(c.mem);
+        model_destroy(&c.m);
+
+        steps -= round;
+    }
+}
+
+/*
+ * The other allocators, which only need alloc, free and reset.
+ */
+
+struct subject {
+    const char* name;
+    void*  (*init)(size_t size, size_t count);
+    void*  (*alloc)(void* ctx, size_t size);
+    void   (*free)(void* ctx, void* p);
+    void   (*reset)(void* ctx);
+    void   (*destroy)(void* ctx);
+    bool   bounded;  // Returns NULL exactly when `count' elements are live.
+    bool   variable; // Takes any size up to `size'.
+};
+
+// Objects of any size, odd ones included, are still aligned.
+static void* bitmap_init(size_t size, size_t count)
+{
+    return bitmap_arena_init(size + below(8), count);
+}
+
+static void* bitmap_alloc(void* ctx, size_t size)
+{
+    void* p = bitmap_arena_alloc(ctx);
+    (void)size;
+    check((uintptr_t)p % sizeof(void*) == 0);
+    return p;
+}
+
+static void  bitmap_free(void* ctx, void* p)        { bitmap_arena_free(ctx, p); }
+static void  bitmap_reset(void* ctx)                { bitmap_arena_reset(ctx); }
+static void  bitmap_destroy(void* ctx)              { bitmap_arena_destroy(ctx); }
+
+static void* growable_init(size_t size, size_t count)
+{
+    // Fixed-size or growing slabs, keeping up to two empty. Growth never
+    // starts over, so with slabs coming and going, only fixed-size ones can
+    // go uncapped.
+    struct growable_policy p = {
+        .initial = below(2) == 0 ? 4 : 1 + count/16,
+        .growth  = 1 + below(2),
+        .max     = count,
+        .retain  = below(3)
+    };
+
+    if(p.growth == 1 && below(2) == 0)
+        p.max = 0;
+    return growable_arena_init(size, p);
+}
+
+static void* growable_alloc(void* ctx, size_t size) { (void)size; return growable_arena_alloc(ctx); }
+static void  growable_free(void* ctx, void* p)      { growable_arena_free(ctx, p); }
+static void  growable_reset(void* ctx)              { growable_arena_reset(ctx); }
+static void  growable_destroy(void* ctx)            { growable_arena_destroy(ctx); }
+
+static void* classes_init(size_t size, size_t count)
+{
+    // The defaults, or classes which aren't multiples of the alignment.
+    static const size_t odd[] = { 20, 40, 100, 250, 1000, 1024 };
+
+    (void)size;
+    return below(2) == 0 ? size_classes_init(NULL, 0, 16*1024 + count*64)
+                         : size_classes_init(odd, sizeof(odd)/sizeof(odd[0]), 16*1024 + count*64);
+}
+
+static void* classes_alloc(void* ctx, size_t size)
+{
+    void* p = size_classes_alloc(ctx, size);
+    check(p == NULL || (size_classes_size(ctx, p) >= size && (uintptr_t)p % 16 == 0));
+    return p;
+}
+
+static void  classes_free(void* ctx, void* p) { size_classes_free(ctx, p); }
+static void  classes_reset(void* ctx)         { size_classes_reset(ctx); }
+static void  classes_destroy(void* ctx)       { size_classes_destroy(ctx); }
+
+static const struct subject subjects[] = {
+    { "bitmap_arena",   bitmap_init,   bitmap_alloc,   bitmap_free,   bitmap_reset,   bitmap_destroy,   true,  false },
+    { "growable_arena", growable_init, growable_alloc, growable_free, growable_reset, growable_destroy, false, false },
+    { "size_classes",   classes_init,  classes_alloc,  classes_free,  classes_reset,  classes_destroy,  false, true  },
+};
+
+static void test_subject(const struct subject* t, uint64_t steps)
+{
+    while(steps > 0)
+    {
+        size_t size  = t->variable ? 1024 : 8*(2 + below(25));
+        size_t count = 1 + below(5000);
+        void*  ctx   = t->init(size, count);
+        check(ctx != NULL);
+
+        // Live elements remember their size in a table of their own; the
+        // model only has room for the tag.
+        struct model m;
+        model_init(&m, t->bounded ? count : 8*count);
+
+        size_t* sizes = malloc(m.cap*sizeof(size_t));
+        check(sizes != NULL);
+
+        uint64_t round = 1000 + below(20000);
+        if(round > steps) round = steps;
+
+        for(uint64_t s = 0; s < round; ++s, ++step)
+        {
+            size_t r = below(100);
+
+            if(r < 50 && m.n < m.cap)
+            {
+                size_t want = t->variable ? 16 + below(size - 15) : size; // Room for both tags.
+                void*  p    = t->alloc(ctx, want);
+
+                if(p == NULL)
+                    check(!t->bounded || m.n == count);
+                else
+                {
+                    sizes[m.n] = want;
+                    model_add(&m, p, want);
+                }
+            }
+            else if(r < 98 && m.n > 0)
+            {
+                size_t k = below(m.n);
+                size_t n = sizes[k];
+
+                sizes[k] = sizes[m.n - 1];
+                t->free(ctx, model_take(&m, k, n));
+            }
+            else if(r == 99)
+            {
+                t->reset(ctx);
+                model_clear(&m);
+            }
+        }
+
+        for(size_t k = 0; k < m.n; ++k)
+            check(has_tag(m.live[k], sizes[k], m.tags[k]));
+
+        t->destroy(ctx);
+        free(sizes);
+        model_destroy(&m);
+
+        steps -= round;
+    }
+}
+
+/*
+ * The modules with nothing to drive at random: persistent arenas, mmap-backed
+ * arenas and dirty snapshots.
+ */
+
+#define PERSISTED 100
+
+static void test_persistent(void)
+{
+    char path[] = "/tmp/arena-test-XXXXXX";
+    int  fd = mkstemp(path);
+    check(fd >= 0);
+    close(fd);
+
+    struct persistent_arena* a = persistent_arena_create(path, 24, PERSISTED);
+    check(a != NULL);
+
+    uint64_t off[PERSISTED];
+
+    for(uint64_t i = 0; i < PERSISTED; ++i)
+    {
+        uint64_t* p = persistent_arena_alloc(a);
+        check(p != NULL);
+
+        p[0] = i;
+        p[1] = i*3;
+        off[i] = persistent_arena_offset(a, p);
+    }
+
+    check(persistent_arena_alloc(a) == NULL);
+    persistent_arena_free(a, persistent_arena_at(a, off[50]));
+    persistent_arena_free(a, persistent_arena_at(a, off[51]));
+
+    // Opened again while the first mapping is still there, so that it's
+    // mapped somewhere else.
+    struct persistent_arena* b = persistent_arena_open(path);
+    check(b != NULL && persistent_arena_at(b, off[0]) != persistent_arena_at(a, off[0]));
+
+    for(uint64_t i = 0; i < PERSISTED; ++i)
+    {
+        const uint64_t* p = persistent_arena_at(b, off[i]);
+        check(i == 50 || i == 51 || (p[0] == i && p[1] == i*3));
+    }
+
+    // The free list came along, most recently freed first.
+    check(persistent_arena_alloc(b) == persistent_arena_at(b, off[51]));
+
+    persistent_arena_close(a);
+    persistent_arena_close(b);
+
+    // And across closing it.
+    struct persistent_arena* c = persistent_arena_open(path);
+    check(c != NULL);
+    check(persistent_arena_alloc(c) == persistent_arena_at(c, off[50]));
+    check(persistent_arena_alloc(c) == NULL);
+    persistent_arena_close(c);
+
+    // Damaged files are turned away. The free list head sits at byte 40 of
+    // the header (see persistent_arena.c), as an offset plus one.
+    fd = open(path, O_RDWR);
+    check(fd >= 0);
+
+    const uint64_t bad[] = { 8 + 1, 24*PERSISTED + 1 }; // Mid-element, past the end.
+
+    for(size_t i = 0; i < 2; ++i)
+    {
+        check(pwrite(fd, &bad[i], sizeof(bad[i]), 40) == sizeof(bad[i]));
+        check(persistent_arena_open(path) == NULL);
+    }
+
+    const uint64_t none = 0;
+    check(pwrite(fd, &none, sizeof(none), 40) == sizeof(none));
+    check((c = persistent_arena_open(path)) != NULL);
+    persistent_arena_close(c);
+
+    // So are files cut short.
+    off_t len = lseek(fd, 0, SEEK_END);
+    check(len > 0 && ftruncate(fd, len - 1) == 0);
+    check(persistent_arena_open(path) == NULL);
+
+    close(fd);
+    unlink(path);
+}
+
+#define MAPPED 1000
+
+static void test_mmap(void)
+{
+    static void* p[MAPPED];
+
+    const struct arena_mmap_opts opts[] = {
+        { .thp = true, .node = ARENA_NUMA_ANY },
+        { .hugetlb = true, .align = 64, .node = ARENA_NUMA_ANY },
+        { .node = 0 },
+        { .node = ARENA_NUMA_INTERLEAVE },
+    };
+
+    for(size_t k = 0; k <= sizeof(opts)/sizeof(opts[0]); ++k)
+    {
+        const struct arena_mmap_opts* o = k < sizeof(opts)/sizeof(opts[0]) ? &opts[k] : NULL;
+        struct arena* a = arena_init_mmap(64, MAPPED, o);
+
+        // Binding fails without NUMA support, but nothing else may.
+        if(a == NULL)
+        {
+            check(o != NULL && o->node != ARENA_NUMA_ANY);
+            continue;
+        }
+
+        for(size_t i = 0; i < MAPPED; ++i)
+        {
+            check((p[i] = arena_alloc(a)) != NULL);
+            check(o == NULL || o->align == 0 || (uintptr_t)p[i] % o->align == 0);
+            put_tag(p[i], 64, i);
+        }
+
+        check(arena_alloc(a) == NULL);
+
+        for(size_t i = 0; i < MAPPED; ++i)
+        {
+            check(has_tag(p[i], 64, i));
+            arena_free(a, p[i]);
+        }
+
+        arena_destroy_mmap(a);
+    }
+
+    // Nodes past the highest one supported never work.
+    struct arena_mmap_opts far = { .node = 64 };
+    check(arena_init_mmap(64, MAPPED, &far) == NULL);
+
+    // A set has at least one node, so at least `count' elements.
+    struct arena_numa_set* s = arena_numa_set_init(64, MAPPED, NULL);
+    check(s != NULL && arena_numa_local(s) != NULL);
+
+    for(size_t i = 0; i < MAPPED; ++i)
+    {
+        check((p[i] = arena_numa_alloc(s)) != NULL);
+        put_tag(p[i], 64, i);
+    }
+
+    for(size_t i = 0; i < MAPPED; ++i)
+    {
+        check(has_tag(p[i], 64, i));
+        arena_numa_free(s, p[i]);
+    }
+
+    arena_numa_set_destroy(s);
+}
+
+#define SNAPPED 512
+
+// A base snapshot and a dirty one on top, restored into another arena. Where
+// soft-dirty bits can't be read, arena_snapshot_dirty fails without writing
+// anything, and a full snapshot stands in for it.
+static void test_dirty_snapshots(void)
+{
+    struct arena* a = arena_init(64, SNAPPED);
+    struct arena* b = arena_init(64, SNAPPED);
+    check(a != NULL && b != NULL);
+
+    void* p[SNAPPED];
+
+    for(size_t i = 0; i < SNAPPED; ++i)
+    {
+        check((p[i] = arena_alloc(a)) != NULL);
+        put_tag(p[i], 64, i);
+    }
+
+    FILE* base  = tmpfile();
+    FILE* delta = tmpfile();
+    check(base != NULL && delta != NULL);
+
+    bool tracking = arena_track_dirty();
+    check(arena_snapshot(a, fileno(base)));
+
+    for(size_t i = 0; i < SNAPPED; i += 100)
+        put_tag(p[i], 64, ~(uint64_t)i);
+
+    arena_free(a, p[7]);
+
+    if(tracking)
+        check(arena_snapshot_dirty(a, fileno(delta)));
+    else
+    {
+        check(!arena_snapshot_dirty(a, fileno(delta)));
+        check(lseek(fileno(delta), 0, SEEK_END) == 0);
+        check(arena_snapshot(a, fileno(delta)));
+    }
+
+    check(lseek(fileno(base), 0, SEEK_SET) == 0 && lseek(fileno(delta), 0, SEEK_SET) == 0);
+    check(arena_restore(b, fileno(base)));
+    check(arena_restore(b, fileno(delta)));
+
+    for(size_t i = 0; i < SNAPPED; ++i)
+    {
+        const char* q = (const char*)b->buffer + i*b->size;
+        check(i == 7 || memcmp(q, p[i], 64) == 0);
+    }
+
+    // The free list came along too.
+    check(arena_alloc(b) == (char*)b->buffer + 7*b->size);
+    check(arena_alloc(b) == NULL);
+
+    fclose(base);
+    fclose(delta);
+    arena_destroy(a);
+    arena_destroy(b);
+}
+
+/*
+ * The profiler, when arena.c is built with it.
+ */
+
+#ifdef ARENA_PROFILE
+
+static void* volatile allocated;
+
+// Allocates one element from `a', one way or the other, and sets `*ret' to
+// where it returns to. Not inlined, and not a tail call, so that it has a
+// frame of its own for the sample's stack to start in.
+__attribute__((noinline))
+static void alloc_here(struct arena* a, bool many, void** ret)
+{
+    void* p = NULL;
+
+    *ret = __builtin_return_address(0);
+
+    if(many)
+        check(arena_alloc_n(a, &p, 1) == 1);
+    else
+        p = arena_alloc(a);
+
+    allocated = p;
+}
+
+struct found {
+    const struct arena* a;
+    const void*         p;
+    size_t              seen, depth;
+    void*               second; // The stack's second frame.
+};
+
+static void find_sample(const struct arena_sample* s, void* ctx)
+{
+    struct found* f = ctx;
+
+    if(s->arena != f->a || s->p != f->p)
+        return;
+
+    ++f->seen;
+    f->depth  = s->depth;
+    f->second = s->depth > 1 ? s->stack[1] : NULL;
+}
+
+// Reads back arena_profile_dump's output. The buckets have to add up to the
+// totals, and the two samples alloc_here took (one per way of allocating)
+// each have a bucket of their own, with a stack that goes through `ret'.
+static void check_dump(void* ret)
+{
+    FILE* f = tmpfile();
+    check(f != NULL && arena_profile_dump(f));
+    rewind(f);
+
+    char   line[4096];
+    size_t live, bytes, allocs, alloc_bytes, rate;
+
+    check(fgets(line, sizeof(line), f) != NULL);
+    check(sscanf(line, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                 &live, &bytes, &allocs, &alloc_bytes, &rate) == 5);
+    check(rate == 1 && live >= 2 && allocs >= live);
+
+    size_t sum[4] = { 0 }, ours = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL && strcmp(line, "\n") != 0)
+    {
+        size_t b[4];
+        int    at;
+
+        check(sscanf(line, "%zu: %zu [%zu: %zu] @%n", &b[0], &b[1], &b[2], &b[3], &at) == 4);
+
+        for(int i = 0; i < 4; ++i)
+            sum[i] += b[i];
+
+        // The rest are the stack's addresses, in hex.
+        char*  c = line + at;
+        size_t depth = 0;
+        bool   through = false;
+
+        for(char* end; *c != '\n' && *c != '\0'; c = end, ++depth)
+        {
+            uintptr_t pc = (uintptr_t)strtoull(c, &end, 16);
+            check(end != c && pc != 0);
+            through |= depth == 1 && pc == (uintptr_t)ret;
+        }
+
+        check(depth >= 1 && depth <= PROFILE_DEPTH);
+
+        if(through)
+        {
+            check(b[0] == 1 && b[1] == 64 && b[2] == 1 && b[3] == 64);
+            ++ours;
+        }
+    }
+
+    check(sum[0] == live && sum[1] == bytes && sum[2] == allocs && sum[3] == alloc_bytes);
+    check(ours == 2);
+
+    // Then the mappings, for pprof to symbolize with.
+    check(fgets(line, sizeof(line), f) != NULL && strcmp(line, "MAPPED_LIBRARIES:\n") == 0);
+
+    bool text = false;
+    while(fgets(line, sizeof(line), f) != NULL)
+        text |= strstr(line, " r-xp ") != NULL;
+
+    check(text);
+    fclose(f);
+}
+
+static void test_profile(void)
+{
+    arena_profile_set_rate(1); // Every allocation.
+
+    struct arena* a = arena_init(64, 16);
+    check(a != NULL);
+
+    // The stack starts in the function which called into the arena, so
+    // its second frame is where that one returns to.
+    void* ret = NULL;
+
+    for(int many = 0; many < 2; ++many)
+    {
+        alloc_here(a, many, &ret);
+
+        struct found f = { .a = a, .p = allocated };
+        check(f.p != NULL);
+
+        arena_profile_visit(find_sample, &f);
+        check(f.seen == 1 && f.depth >= 2 && f.second == ret);
+    }
+
+    check_dump(ret);
+
+    arena_destroy(a);
+    arena_profile_set_rate(PROFILE_RATE);
+}
+
+#endif
+
+/*
+ * Threads. Each element is tagged with who allocated it; a thread finding
+ * somebody else's tag on an element it owns means the same element was
+ * handed out twice.
+ */
+
+#define ELEMENT 64
+
+struct stress {
+    uint64_t steps;
+
+    struct arena*      arena;    // For the atomic variants.
+    struct arena_pool* pool;
+    struct arena_mt*   mt;
+
+    pthread_mutex_t lock;        // Guards the mailbox.
+    void*           mailbox[64]; // Elements passed between threads.
+};
+
+struct worker {
+    struct stress* s;
+    uint64_t       id, rng;
+};
+
+static uint64_t worker_next(struct worker* w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * UINT64_C(2685821657736338717);
+}
+
+static void mark_mine(void* p, uint64_t tag)
+{
+    if(p != NULL) put_tag(p, ELEMENT, tag);
+}
+
+// Swaps `p' with whatever's in a random mailbox slot, which may be another
+// thread's element (or NULL).
+static void* swap_mail(struct worker* w, void* p)
+{
+    struct stress* s = w->s;
+    size_t i = (size_t)(worker_next(w) % 64);
+
+    pthread_mutex_lock(&s->lock);
+    void* q = s->mailbox[i];
+    s->mailbox[i] = p;
+    pthread_mutex_unlock(&s->lock);
+
+    return q;
+}
+
+// Which thread's element it is, from its tag. The mailbox's lock publishes it.
+static uint64_t owner_of(const void* p)
+{
+    uint64_t a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, (const char*)p + ELEMENT - sizeof(b), sizeof(b));
+    check(a == b);
+    return a;
+}
+
+static void* atomic_worker(void* arg)
+{
+    struct worker* w = arg;
+    void* held[16] = { NULL };
+
+    for(uint64_t i = 0; i < w->s->steps; ++i)
+    {
+        size_t k = (size_t)(worker_next(w) % 16);
+
+        if(held[k] != NULL)
+        {
+            check(has_tag(held[k], ELEMENT, w->id));
+            arena_free_atomic(w->s->arena, held[k]);
+        }
+
+        mark_mine(held[k] = arena_alloc_atomic(w->s->arena), w->id);
+    }
+
+    for(size_t k = 0; k < 16; ++k)
+        if(held[k] != NULL)
+            arena_free_atomic(w->s->arena, held[k]);
+
+    return NULL;
+}
+
+static void* pool_worker(void* arg)
+{
+    struct worker* w = arg;
+    struct arena_shard* shard = arena_pool_join(w->s->pool);
+    check(shard != NULL);
+
+    void* held[16] = { NULL };
+
+    for(uint64_t i = 0; i < w->s->steps; ++i)
+    {
+        size_t k = (size_t)(worker_next(w) % 16);
+
+        if(held[k] != NULL)
+        {
+            check(has_tag(held[k], ELEMENT, w->id));
+
+            // Half of them go through the mailbox, to be freed by whichever
+            // thread picks them up: a remote free, mostly.
+            void* p = worker_next(w) % 2 ? swap_mail(w, held[k]) : held[k];
+
+            if(p != NULL)
+            {
+                owner_of(p);
+                arena_pool_free(shard, p);
+            }
+        }
+
+        mark_mine(held[k] = arena_pool_alloc(shard), w->id);
+    }
+
+    for(size_t k = 0; k < 16; ++k)
+        arena_pool_free(shard, held[k]);
+
+    arena_pool_leave(shard);
+    return NULL;
+}
+
+static void* magazine_worker(void* arg)
+{
+    struct worker* w = arg;
+    struct magazine mag;
+    magazine_init(&mag, w->s->mt);
+
+    void* held[16] = { NULL };
+
+    for(uint64_t i = 0; i < w->s->steps; ++i)
+    {
+        size_t k = (size_t)(worker_next(w) % 16);
+
+        if(held[k] != NULL)
+        {
+            check(has_tag(held[k], ELEMENT, w->id));
+
+            void* p = worker_next(w) % 2 ? swap_mail(w, held[k]) : held[k];
+
+            if(p != NULL)
+            {
+                owner_of(p);
+                magazine_free(&mag, p);
+            }
+        }
+
+        mark_mine(held[k] = magazine_alloc(&mag), w->id);
+    }
+
+    for(size_t k = 0; k < 16; ++k)
+        if(held[k] != NULL)
+            magazine_free(&mag, held[k]);
+
+    magazine_destroy(&mag);
+    return NULL;
+}
+
+// The owner allocates; everybody else frees its elements remotely.
+static void* remote_owner(void* arg)
+{
+    struct worker* w = arg;
+
+    for(uint64_t i = 0; i < w->s->steps; ++i)
+    {
+        void* p = arena_alloc(w->s->arena);
+
+        if(p == NULL) continue;
+
+        mark_mine(p, w->id);
+        p = swap_mail(w, p);
+
+        if(p != NULL)
+            arena_free(w->s->arena, p);
+    }
+
+    return NULL;
+}
+
+static void* remote_freer(void* arg)
+{
+    struct worker* w = arg;
+
+    for(uint64_t i = 0; i < w->s->steps; ++i)
+    {
+        void* p = swap_mail(w, NULL);
+
+        if(p != NULL)
+        {
+            owner_of(p);
+            arena_free_remote(w->s->arena, p);
+        }
+    }
+
+    return NULL;
+}
+
+static void run_threads(struct stress* s, void* (*first)(void*), void* (*rest)(void*))
+{
+    pthread_t     tid[TEST_THREADS];
+    struct worker w[TEST_THREADS];
+
+    memset(s->mailbox, 0, sizeof(s->mailbox));
+
+    for(size_t i = 0; i < TEST_THREADS; ++i)
+    {
+        w[i] = (struct worker) { .s = s, .id = 2*i + 1, .rng = next() | 1 };
+        check(pthread_create(&tid[i], NULL, i == 0 ? first : rest, &w[i]) == 0);
+    }
+
+    for(size_t i = 0; i < TEST_THREADS; ++i)
+        pthread_join(tid[i], NULL);
+}
+
+// Hands what's left in the mailbox back, however `release' does it.
+static void empty_mailbox(struct stress* s, void (*release)(struct stress*, void*))
+{
+    for(size_t i = 0; i < 64; ++i)
+        if(s->mailbox[i] != NULL)
+            release(s, s->mailbox[i]);
+}
+
+static void release_remote(struct stress* s, void* p)   { arena_free(s->arena, p); }
+
+static void release_pool(struct stress* s, void* p)
+{
+    struct arena_shard* shard = arena_pool_join(s->pool);
+    arena_pool_free(shard, p);
+    arena_pool_leave(shard);
+}
+
+static void release_magazine(struct stress* s, void* p)
+{
+    struct magazine mag;
+    magazine_init(&mag, s->mt);
+    magazine_free(&mag, p);
+    magazine_destroy(&mag);
+}
+
+// One shard frees everything it has locally, and another then has to get at
+// it: first by asking, which the shard answers on its next call, then by
+// borrowing once it's been left. One thread joins both, to get the order.
+static void test_pool_steal(void)
+{
+    struct arena_pool* pool = arena_pool_init(ELEMENT, 32, 2);
+    check(pool != NULL);
+
+    struct arena_shard* a = arena_pool_join(pool);
+    struct arena_shard* b = arena_pool_join(pool);
+    check(a != NULL && b != NULL && a != b && arena_pool_join(pool) == NULL);
+
+    void*  got[64];
+    size_t n = 0;
+
+    for(size_t i = 0; i < 32; ++i)
+        check((got[i] = arena_pool_alloc(a)) != NULL);
+
+    for(size_t i = 0; i < 32; ++i)
+        arena_pool_free(a, got[i]);
+
+    // b's own, then nothing: a's still joined, so b can only ask.
+    while(n < 64 && (got[n] = arena_pool_alloc(b)) != NULL)
+        put_tag(got[n], ELEMENT, n), ++n;
+
+    check(n == 32);
+
+    // a gives up all it has left after this alloc.
+    void* x = arena_pool_alloc(a);
+    check(x != NULL);
+    arena_pool_free(a, x);
+
+    while(n < 64 && (got[n] = arena_pool_alloc(b)) != NULL)
+        put_tag(got[n], ELEMENT, n), ++n;
+
+    check(n == 63);
+
+    // Once a is left, b takes the last one by itself.
+    arena_pool_leave(a);
+
+    while(n < 64 && (got[n] = arena_pool_alloc(b)) != NULL)
+        put_tag(got[n], ELEMENT, n), ++n;
+
+    check(n == 64 && arena_pool_alloc(b) == NULL);
+
+    for(size_t i = 0; i < 64; ++i)
+    {
+        check(has_tag(got[i], ELEMENT, i));
+        arena_pool_free(b, got[i]);
+    }
+
+    arena_pool_leave(b);
+
+    // Everything went home, where one shard can get at all of it again.
+    a = arena_pool_join(pool);
+    check(a != NULL);
+
+    for(size_t i = 0; i < 64; ++i)
+        check((got[i] = arena_pool_alloc(a)) != NULL);
+
+    check(arena_pool_alloc(a) == NULL);
+
+    for(size_t i = 0; i < 64; ++i)
+        arena_pool_free(a, got[i]);
+
+    arena_pool_leave(a);
+    arena_pool_destroy(pool);
+}
+
+static void test_threads(uint64_t steps)
+{
+    struct stress s = { .steps = steps };
+    pthread_mutex_init(&s.lock, NULL);
+
+    // Few enough elements that threads keep running out.
+    s.arena = arena_init(ELEMENT, 8*TEST_THREADS);
+    check(s.arena != NULL);
+    run_threads(&s, atomic_worker, atomic_worker);
+    arena_destroy(s.arena);
+
+    s.arena = arena_init(ELEMENT, 32);
+    check(s.arena != NULL);
+    run_threads(&s, remote_owner, remote_freer);
+    empty_mailbox(&s, release_remote);
+    arena_destroy(s.arena);
+
+    test_pool_steal();
+
+    s.pool = arena_pool_init(ELEMENT, 32, TEST_THREADS);
+    check(s.pool != NULL);
+    run_threads(&s, pool_worker, pool_worker);
+    empty_mailbox(&s, release_pool);
+    arena_pool_destroy(s.pool);
+
+    s.mt = arena_mt_init(ELEMENT, 64*TEST_THREADS);
+    check(s.mt != NULL);
+    run_threads(&s, magazine_worker, magazine_worker);
+    empty_mailbox(&s, release_magazine);
+    arena_mt_destroy(s.mt);
+
+    pthread_mutex_destroy(&s.lock);
+}
+
+int main(int argc, char** argv)
+{
+    const char* mode  = argc > 1 ? argv[1] : "model";
+    uint64_t    steps = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+
+    seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+
+    if(seed == 0)
+        seed = (uint64_t)time(NULL) ^ (uint64_t)clock() << 32;
+
+    rng = seed | 1;
+
+    if(strcmp(mode, "model") == 0)
+    {
+        if(steps == 0) steps = 200000;
+
+        printf("model: %" PRIu64 " steps, seed %" PRIu64 "\n", steps, seed);
+        test_arena(steps);
+
+        for(size_t i = 0; i < sizeof(subjects)/sizeof(subjects[0]); ++i)
+            test_subject(&subjects[i], steps/4);
+
+        test_persistent();
+        test_mmap();
+        test_dirty_snapshots();
+
+    #ifdef ARENA_PROFILE
+        test_profile();
+    #endif
+    }
+    else if(strcmp(mode, "threads") == 0)
+    {
+        if(steps == 0) steps = 100000;
+
+        printf("threads: %" PRIu64 " steps, %d threads, seed %" PRIu64 "\n",
+               steps, TEST_THREADS, seed);
+        test_threads(steps);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s model|threads [steps] [seed]\n", argv[0]);
+        return 2;
+    }
+
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * The tests of arena.hpp behind `make test' (see the Makefile), built once as
+ * C++17 and once as C++20, so that alloc_async is covered too. Everything is
+ * a template, so only what gets instantiated here is ever compiled.
+ */
+
+#include "arena.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+    #include <list>
+    #include <memory_resource>
+#endif
+
+#define check(cond) \
+    ((cond) ? (void)0 : fail(#cond, __FILE__, __LINE__))
+
+static void fail(const char* what, const char* file, int line)
+{
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    std::abort();
+}
+
+using arena_alloc::arena;
+
+struct counted {
+    static int live;
+
+    explicit counted(int v) : value(v) { ++live; }
+    ~counted() { --live; }
+
+    int value;
+};
+
+int counted::live = 0;
+
+struct throws {
+    throws() { throw std::runtime_error("no"); }
+};
+
+static void test_construct()
+{
+    arena<counted, 8> a;
+    counted* c[8];
+
+    for(int i = 0; i < 8; ++i)
+    {
+        c[i] = a.construct(i);
+        check(c[i] != nullptr && c[i]->value == i && a.owns(c[i]));
+    }
+
+    check(counted::live == 8);
+    check(a.construct(8) == nullptr);
+
+    // The most recently freed slot comes back first.
+    a.destroy(c[3]);
+    check(counted::live == 7);
+    check(a.construct(33) == c[3] && c[3]->value == 33);
+
+    a.destroy(nullptr);
+
+    // Everything's free again, from the bottom up, with no destructors run.
+    a.reset();
+    check(counted::live == 8);
+    check(a.alloc() == c[0]);
+    counted::live = 0;
+
+    int local;
+    check(!a.owns(&local));
+
+    // A throwing constructor gives its storage back.
+    arena<throws, 1> t;
+    bool thrown = false;
+
+    try {
+        t.construct();
+    } catch(const std::runtime_error&) {
+        thrown = true;
+    }
+
+    check(thrown && t.alloc() != nullptr && t.alloc() == nullptr);
+}
+
+#if __has_include(<memory_resource>)
+
+// Big enough for a std::list<int> node.
+using node_arena = arena<std::array<void*, 4>, 64>;
+
+static void test_resource()
+{
+    node_arena a;
+    arena_alloc::arena_resource<node_arena> r(a);
+
+    {
+        std::pmr::list<int> l(&r);
+        int owned = 0, sum = 0;
+
+        for(int i = 0; i < 100; ++i)
+            l.push_back(i);
+
+        // The first 64 nodes fit, the rest went upstream.
+        for(int& i : l)
+        {
+            owned += a.owns(&i);
+            sum   += i;
+        }
+
+        check(owned == 64 && sum == 99*100/2);
+        check(a.alloc() == nullptr);
+    }
+
+    // The list gave every node back.
+    for(int i = 0; i < 64; ++i)
+        check(a.alloc() != nullptr);
+}
+
+#endif
+
+#ifdef ARENA_COROUTINES
+
+// Runs eagerly until its first suspension, and is destroyed with the object.
+struct task {
+    struct promise_type {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::abort(); }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    task(task&& t) noexcept : handle(std::exchange(t.handle, nullptr)) {}
+    task& operator=(task&&) = delete;
+    ~task() { if(handle) handle.destroy(); }
+
+    bool done() const { return handle.done(); }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+using small_arena = arena<int, 2>;
+
+struct served {
+    void* p[4]     = {};
+    int   order[4] = {};
+    int   n        = 0;
+};
+
+static task take(small_arena& a, served& s, int id)
+{
+    void* p = co_await a.alloc_async();
+
+    s.p[id] = p;
+    s.order[s.n++] = id;
+}
+
+// Passes whatever it gets on to the next waiter, from inside the free that
+// served it.
+static task pass_on(small_arena& a, served& s, int id, int& hops)
+{
+    void* p = co_await a.alloc_async();
+
+    s.p[id % 4] = p;
+    ++hops;
+    a.free(p);
+}
+
+static void test_async()
+{
+    small_arena a;
+    served s;
+
+    // With room, it's just alloc.
+    task t0(take(a, s, 0));
+    check(t0.done() && s.p[0] != nullptr);
+
+    void* p1 = a.alloc();
+    check(p1 != nullptr && a.alloc() == nullptr);
+
+    // Full: they queue up...
+    task t1(take(a, s, 1));
+    task t2(take(a, s, 2));
+    task t3(take(a, s, 3));
+    check(!t1.done() && !t2.done() && !t3.done() && s.n == 1);
+
+    // ...and are served in order, from inside free.
+    a.free(s.p[0]);
+    check(t1.done() && s.p[1] == s.p[0] && s.order[1] == 1);
+
+    // Destroying a waiter takes it out of the queue.
+    t2.handle.destroy();
+    t2.handle = nullptr;
+
+    a.free(p1);
+    check(t3.done() && s.p[3] == p1 && s.p[2] == nullptr && s.n == 3);
+
+    // reset serves waiters from the bump region.
+    small_arena b;
+    served r;
+    check(b.alloc() != nullptr && b.alloc() != nullptr);
+
+    task u1(take(b, r, 1));
+    task u2(take(b, r, 2));
+    task u3(take(b, r, 3));
+
+    b.reset();
+    check(u1.done() && u2.done() && !u3.done());
+    check(r.order[0] == 1 && r.order[1] == 2 && r.p[1] != r.p[2]);
+
+    // Resumed coroutines can free again, which serves the next waiter one
+    // level down. Once nobody's left, the element goes back on the free list.
+    small_arena c;
+    served q;
+    int hops = 0;
+    void* x = c.alloc();
+    check(x != nullptr && c.alloc() != nullptr);
+
+    std::vector<task> chain;
+    chain.reserve(100);
+
+    for(int i = 0; i < 100; ++i)
+        chain.emplace_back(pass_on(c, q, i, hops));
+
+    check(hops == 0);
+
+    c.free(x);
+    check(hops == 100 && chain.back().done() && q.p[0] == x && q.p[3] == x);
+    check(c.alloc() == x && c.alloc() == nullptr);
+}
+
+#endif
+
+int main()
+{
+    test_construct();
+
+#if __has_include(<memory_resource>)
+    test_resource();
+#endif
+
+#ifdef ARENA_COROUTINES
+    test_async();
+#endif
+
+    std::printf("ok (C++%ld)\n", static_cast<long>(__cplusplus / 100 % 100));
+    return 0;
+}